@@ -0,0 +1,167 @@
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <ostream>
+#include <string_view>
+
+namespace asyncrt {
+
+std::size_t HistogramSnapshot::bucket_index(std::uint64_t value) noexcept {
+    if (value < kSubBuckets) {
+        return static_cast<std::size_t>(value);
+    }
+    auto exponent = static_cast<std::size_t>(std::bit_width(value)) - 1;
+    auto sub_bucket = static_cast<std::size_t>(value >> (exponent - 3)) & (kSubBuckets - 1);
+    return (exponent - 2) * kSubBuckets + sub_bucket;
+}
+
+std::uint64_t HistogramSnapshot::bucket_upper_bound(std::size_t index) noexcept {
+    if (index < kSubBuckets) {
+        return index;
+    }
+    auto exponent = index / kSubBuckets + 2;
+    auto sub_bucket = index % kSubBuckets;
+    auto lower = (kSubBuckets + sub_bucket) << (exponent - 3);
+    return lower + ((std::uint64_t{1} << (exponent - 3)) - 1);
+}
+
+std::uint64_t HistogramSnapshot::quantile(double q) const noexcept {
+    if (count == 0) {
+        return 0;
+    }
+    auto rank = static_cast<std::uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * count));
+    rank = std::max<std::uint64_t>(rank, 1);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBuckets; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(bucket_upper_bound(i), max);
+        }
+    }
+    return max;
+}
+
+double HistogramSnapshot::mean() const noexcept {
+    return count == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(count);
+}
+
+HistogramSnapshot& HistogramSnapshot::operator+=(HistogramSnapshot const& other) noexcept {
+    for (std::size_t i = 0; i < kBuckets; ++i) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+    return *this;
+}
+
+void Histogram::record(std::uint64_t value) noexcept {
+    m_buckets[HistogramSnapshot::bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    auto max = m_max.load(std::memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+void Histogram::snapshot_into(HistogramSnapshot& snapshot) const noexcept {
+    HistogramSnapshot own{};
+    for (std::size_t i = 0; i < HistogramSnapshot::kBuckets; ++i) {
+        own.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    }
+    own.count = m_count.load(std::memory_order_relaxed);
+    own.sum = m_sum.load(std::memory_order_relaxed);
+    own.max = m_max.load(std::memory_order_relaxed);
+    snapshot += own;
+}
+
+namespace {
+
+void write_counter(std::ostream& os, std::string_view name, std::uint64_t value) {
+    os << "# TYPE asyncrt_" << name << " counter\n";
+    os << "asyncrt_" << name << ' ' << value << '\n';
+}
+
+void write_gauge(std::ostream& os, std::string_view name, std::uint64_t value) {
+    os << "# TYPE asyncrt_" << name << " gauge\n";
+    os << "asyncrt_" << name << ' ' << value << '\n';
+}
+
+void write_summary(std::ostream& os, std::string_view name, HistogramSnapshot const& histogram) {
+    os << "# TYPE asyncrt_" << name << " summary\n";
+    for (auto q : {0.5, 0.9, 0.99, 0.999}) {
+        os << "asyncrt_" << name << "{quantile=\"" << q << "\"} " << histogram.quantile(q)
+           << '\n';
+    }
+    os << "asyncrt_" << name << "_max " << histogram.max << '\n';
+    os << "asyncrt_" << name << "_sum " << histogram.sum << '\n';
+    os << "asyncrt_" << name << "_count " << histogram.count << '\n';
+}
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& os, MetricsSnapshot const& snapshot) {
+    write_counter(os, "tasks_spawned_total", snapshot.tasks_spawned);
+    write_counter(os, "tasks_completed_total", snapshot.tasks_completed);
+    write_counter(os, "tasks_panicked_total", snapshot.tasks_panicked);
+    write_counter(os, "tasks_cancelled_total", snapshot.tasks_cancelled);
+    write_counter(os, "tasks_expired_total", snapshot.tasks_expired);
+    write_counter(os, "wakes_total", snapshot.wakes);
+    write_counter(os, "polls_total", snapshot.polls);
+    write_counter(os, "budget_yields_total", snapshot.budget_yields);
+    write_counter(os, "starved_polls_total", snapshot.starved_polls);
+    write_counter(os, "timers_expired_total", snapshot.timers_expired);
+    os << "# TYPE asyncrt_thread_polls_total counter\n";
+    for (std::size_t i = 0; i < snapshot.polls_by_thread.size(); ++i) {
+        os << "asyncrt_thread_polls_total{thread=\"" << i << "\"} " << snapshot.polls_by_thread[i]
+           << '\n';
+    }
+    write_gauge(os, "tasks_active", snapshot.tasks_active);
+    write_gauge(os, "tasks_lingering", snapshot.tasks_lingering);
+    write_gauge(os, "queue_depth", snapshot.queue_depth);
+    write_gauge(os, "timers_pending", snapshot.timers_pending);
+    write_summary(os, "wake_to_poll_nanoseconds", snapshot.wake_to_poll_ns);
+    write_summary(os, "spawn_to_complete_nanoseconds", snapshot.spawn_to_complete_ns);
+    write_summary(os, "polls_per_task", snapshot.polls_per_task);
+    write_counter(os, "pool_allocations_total", snapshot.pool.allocations);
+    write_counter(os, "pool_deallocations_total", snapshot.pool.deallocations);
+    write_counter(os, "pool_oversized_allocations_total", snapshot.pool.oversized);
+    write_counter(os, "pool_chunks_total", snapshot.pool.chunks);
+    write_gauge(os, "pool_reserved_bytes", snapshot.pool.reserved_bytes);
+    return os;
+}
+
+namespace detail {
+
+Metrics::Metrics(std::size_t shards) {
+    m_shards.reserve(shards);
+    for (std::size_t i = 0; i < shards; ++i) {
+        m_shards.emplace_back(std::make_unique<MetricsShard>());
+    }
+}
+
+MetricsSnapshot Metrics::snapshot() const {
+    MetricsSnapshot snapshot{};
+    for (auto const& shard : m_shards) {
+        snapshot.tasks_spawned += shard->tasks_spawned.load(std::memory_order_relaxed);
+        snapshot.tasks_completed += shard->tasks_completed.load(std::memory_order_relaxed);
+        snapshot.tasks_panicked += shard->tasks_panicked.load(std::memory_order_relaxed);
+        snapshot.tasks_cancelled += shard->tasks_cancelled.load(std::memory_order_relaxed);
+        snapshot.tasks_expired += shard->tasks_expired.load(std::memory_order_relaxed);
+        snapshot.wakes += shard->wakes.load(std::memory_order_relaxed);
+        snapshot.budget_yields += shard->budget_yields.load(std::memory_order_relaxed);
+        snapshot.starved_polls += shard->starved_polls.load(std::memory_order_relaxed);
+        auto polls = shard->polls.load(std::memory_order_relaxed);
+        snapshot.polls += polls;
+        snapshot.polls_by_thread.push_back(polls);
+        shard->wake_to_poll_ns.snapshot_into(snapshot.wake_to_poll_ns);
+        shard->spawn_to_complete_ns.snapshot_into(snapshot.spawn_to_complete_ns);
+        shard->polls_per_task.snapshot_into(snapshot.polls_per_task);
+    }
+    return snapshot;
+}
+
+}  // namespace detail
+}  // namespace asyncrt
@@ -0,0 +1,218 @@
+#include "Pool.hpp"
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace asyncrt {
+namespace detail {
+namespace {
+
+constexpr std::array<std::size_t, 5> kClassSizes{64, 128, 256, 512, 1024};
+// blocks moved between a thread and the shared lists at once, and allocated per chunk
+constexpr std::size_t kBatchSize = 32;
+
+struct Block {
+    Block* next;
+};
+
+struct FreeList {
+    Block* head{nullptr};
+    std::size_t count{0};
+
+    void push(Block* block) noexcept {
+        block->next = head;
+        head = block;
+        ++count;
+    }
+
+    Block* pop() noexcept {
+        auto* block = head;
+        head = block->next;
+        --count;
+        return block;
+    }
+};
+
+std::size_t class_index(std::size_t size) noexcept {
+    std::size_t index = 0;
+    while (index < kClassSizes.size() && kClassSizes[index] < size) {
+        ++index;
+    }
+    return index;
+}
+
+struct ThreadCache;
+
+// Lists and counters shared by all threads.
+struct Central {
+    std::mutex mutex{};
+    std::array<std::vector<FreeList>, kClassSizes.size()> batches{};
+    std::vector<std::unique_ptr<std::byte[]>> chunks{};
+    std::vector<ThreadCache*> caches{};
+    // the chunks, and the counters of threads which exited
+    PoolStats stats{};
+};
+
+Central& central() {
+    // never destroyed, threads may still free blocks while static objects are destroyed
+    static auto* instance = new Central{};
+    return *instance;
+}
+
+struct ThreadCache {
+    ThreadCache();
+    ~ThreadCache();
+
+    void refill(std::size_t index);
+    void flush(std::size_t index, std::size_t count);
+
+    std::array<FreeList, kClassSizes.size()> lists{};
+    // only written by the owning thread, atomic so pool_stats() can read them
+    std::atomic<std::uint64_t> allocations{0};
+    std::atomic<std::uint64_t> deallocations{0};
+    std::atomic<std::uint64_t> oversized{0};
+};
+
+// Set while the cache of the thread exists. Blocks freed during thread exit after the cache was
+// destroyed go to the shared lists directly.
+thread_local ThreadCache* t_cache = nullptr;
+// Set once the cache of the thread was destroyed, its owner must not be used anymore afterwards.
+thread_local bool t_exited = false;
+
+ThreadCache::ThreadCache() {
+    auto& shared = central();
+    std::lock_guard lock{shared.mutex};
+    shared.caches.push_back(this);
+}
+
+ThreadCache::~ThreadCache() {
+    auto& shared = central();
+    std::lock_guard lock{shared.mutex};
+    for (std::size_t index = 0; index < lists.size(); ++index) {
+        if (lists[index].count > 0) {
+            shared.batches[index].push_back(lists[index]);
+        }
+    }
+    shared.stats.allocations += allocations.load(std::memory_order_relaxed);
+    shared.stats.deallocations += deallocations.load(std::memory_order_relaxed);
+    shared.stats.oversized += oversized.load(std::memory_order_relaxed);
+    std::erase(shared.caches, this);
+}
+
+void ThreadCache::refill(std::size_t index) {
+    auto& shared = central();
+    std::lock_guard lock{shared.mutex};
+    auto& batches = shared.batches[index];
+    if (!batches.empty()) {
+        lists[index] = batches.back();
+        batches.pop_back();
+        return;
+    }
+    auto block_size = kClassSizes[index];
+    auto& chunk = shared.chunks.emplace_back(new std::byte[block_size * kBatchSize]);
+    for (std::size_t i = 0; i < kBatchSize; ++i) {
+        lists[index].push(reinterpret_cast<Block*>(chunk.get() + i * block_size));
+    }
+    shared.stats.chunks += 1;
+    shared.stats.reserved_bytes += block_size * kBatchSize;
+}
+
+void ThreadCache::flush(std::size_t index, std::size_t count) {
+    FreeList batch{};
+    while (batch.count < count) {
+        batch.push(lists[index].pop());
+    }
+    auto& shared = central();
+    std::lock_guard lock{shared.mutex};
+    shared.batches[index].push_back(batch);
+}
+
+ThreadCache* local_cache() {
+    struct Owner {
+        Owner() { t_cache = &cache; }
+        ~Owner() {
+            t_cache = nullptr;
+            t_exited = true;
+        }
+
+        ThreadCache cache{};
+    };
+    if (t_exited) {
+        return nullptr;
+    }
+    // constructed on first use, afterwards t_cache is only reset when the thread exits
+    thread_local Owner owner{};
+    return t_cache;
+}
+
+}  // namespace
+
+void* pool_allocate(std::size_t size) {
+    auto index = class_index(size);
+    auto* cache = local_cache();
+    if (index == kClassSizes.size()) {
+        if (cache != nullptr) {
+            cache->oversized.fetch_add(1, std::memory_order_relaxed);
+        }
+        return ::operator new(size);
+    }
+    if (cache == nullptr) {
+        // only during thread exit, keep it simple and take a fresh block from the system
+        auto* block = ::operator new(kClassSizes[index]);
+        auto& shared = central();
+        std::lock_guard lock{shared.mutex};
+        shared.stats.allocations += 1;
+        return block;
+    }
+    if (cache->lists[index].count == 0) {
+        cache->refill(index);
+    }
+    cache->allocations.fetch_add(1, std::memory_order_relaxed);
+    return cache->lists[index].pop();
+}
+
+void pool_deallocate(void* ptr, std::size_t size) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    auto index = class_index(size);
+    if (index == kClassSizes.size()) {
+        ::operator delete(ptr);
+        return;
+    }
+    auto* block = static_cast<Block*>(ptr);
+    auto* cache = local_cache();
+    if (cache == nullptr) {
+        auto& shared = central();
+        std::lock_guard lock{shared.mutex};
+        FreeList batch{};
+        batch.push(block);
+        shared.batches[index].push_back(batch);
+        shared.stats.deallocations += 1;
+        return;
+    }
+    cache->deallocations.fetch_add(1, std::memory_order_relaxed);
+    cache->lists[index].push(block);
+    if (cache->lists[index].count >= 2 * kBatchSize) {
+        cache->flush(index, kBatchSize);
+    }
+}
+
+}  // namespace detail
+
+PoolStats pool_stats() {
+    auto& shared = detail::central();
+    std::lock_guard lock{shared.mutex};
+    auto stats = shared.stats;
+    for (auto const* cache : shared.caches) {
+        stats.allocations += cache->allocations.load(std::memory_order_relaxed);
+        stats.deallocations += cache->deallocations.load(std::memory_order_relaxed);
+        stats.oversized += cache->oversized.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+}  // namespace asyncrt
@@ -0,0 +1,41 @@
+#include "Result.hpp"
+
+#include <cstring>
+#include <new>
+
+namespace asyncrt {
+namespace {
+
+void free_message(char* message) {
+    delete[] message;
+}
+
+}  // namespace
+
+Error Error::from_ffi(::FfiError error) noexcept {
+    std::string message{};
+    if (error.message != nullptr) {
+        try {
+            message = error.message;
+        } catch (...) {
+            // the code is still reported
+        }
+        error.drop(error.message);
+    }
+    return Error{error.code, std::move(message)};
+}
+
+::FfiError Error::to_ffi() const {
+    return make_ffi_error(m_code, m_message);
+}
+
+::FfiError make_ffi_error(ErrorCode code, std::string_view message) noexcept {
+    auto* copy = new (std::nothrow) char[message.size() + 1];
+    if (copy != nullptr) {
+        std::memcpy(copy, message.data(), message.size());
+        copy[message.size()] = '\0';
+    }
+    return ::FfiError{.code = code, .message = copy, .drop = &free_message};
+}
+
+}  // namespace asyncrt
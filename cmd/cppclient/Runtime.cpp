@@ -1,8 +1,9 @@
 #include "Runtime.hpp"
+#include "Trace.hpp"
 
-#include <sstream>
+#include <algorithm>
 
-#include <iostream>  // TODO: debugging only
+#include <boost/asio/post.hpp>
 
 namespace asyncrt {
 namespace detail {
@@ -14,91 +15,354 @@ namespace detail {
     &Waker::drop,
 };
 
-Waker::Waker(Executor& executor, TaskBase& task)
-    : FfiWakerBase{&g_wakerImplVTable}, m_Executor{executor}, m_task{task} {
-    std::cout << "+++ [C] waker " << reinterpret_cast<void*>(this) << " created" << std::endl;
-}
-
-Waker::~Waker() {
-    std::cout << "+++ [C] waker " << reinterpret_cast<void*>(this) << " deleted" << std::endl;
-}
+Waker::Waker(TaskBase& task) : FfiWakerBase{&g_wakerImplVTable}, m_task{task} {}
 
 FfiWakerBase const* Waker::clone_impl() const {
-    auto const* p = new Waker(*this);
-    std::cout << "+++ [C] clone waker " << reinterpret_cast<void const*>(this) << ": "
-              << reinterpret_cast<void const*>(p) << std::endl;
-    return p;
+    ASYNCRT_TRACE(Waker, Debug, "clone waker ", static_cast<void const*>(this));
+    m_task.acquire();
+    return this;
 }
 
 void Waker::wake_impl() const {
-    std::cout << "+++ [C] wake waker " << reinterpret_cast<void const*>(this) << std::endl;
-    m_Executor.ready(m_task);
+    ASYNCRT_TRACE(Waker, Debug, "wake waker ", static_cast<void const*>(this));
+    m_task.wake();
+    m_task.release();
 }
 
 void Waker::wake_by_ref_impl() const {
-    std::cout << "+++ [C] wake_by_ref waker " << reinterpret_cast<void const*>(this) << std::endl;
-    m_Executor.ready(m_task);
+    ASYNCRT_TRACE(Waker, Debug, "wake_by_ref waker ", static_cast<void const*>(this));
+    m_task.wake();
 }
 
 void Waker::drop_impl() const {
-    std::cout << "+++ [C] drop waker " << reinterpret_cast<void const*>(this) << std::endl;
-    delete this;
+    ASYNCRT_TRACE(Waker, Debug, "drop waker ", static_cast<void const*>(this));
+    m_task.release();
 }
 
-TaskBase::TaskBase(Executor& executor, uint64_t id)
-    : m_id{id}, m_waker{make_drop_ptr<Waker>(executor, *this)}, m_context{m_waker.get()} {
-    std::cout << "+++ [C] created task " << id << "                  " << " with context "
-              << &m_context << ", waker " << reinterpret_cast<void*>(m_waker.get()) << ", vtable "
-              << reinterpret_cast<void const*>(m_waker->vtable) << ", wake func "
-              << reinterpret_cast<void const*>(m_waker->vtable->wake) << std::endl;
+TaskBase::TaskBase(Executor& executor, TaskId id)
+    : m_executor{executor},
+      m_id{id},
+      m_waker{*this},
+      m_context{&m_waker},
+      m_spawned_ns{now_ns()},
+      m_scheduled_ns{m_spawned_ns} {
+    ASYNCRT_TRACE(Task, Debug, "created task ", id, " with context ",
+                  static_cast<void const*>(&m_context), ", waker ",
+                  static_cast<void const*>(&m_waker));
 }
 
 TaskBase::~TaskBase() {
-    std::cout << "+++ [C] TaskBase::~TaskBase()" << std::endl;
+    ASYNCRT_TRACE(Task, Debug, "destroyed task ", m_id);
 }
 
-bool TaskBase::poll(Executor& executor) {
-    std::cout << "+++ [C] scheduling task " << m_id << std::endl;
+PollStatus TaskBase::poll(Executor& executor) {
+    ASYNCRT_TRACE(Task, Debug, "polling task ", m_id);
     auto status = poll_impl(executor);
     switch (status) {
     case PollStatus::Ready:
-        std::cout << "+++ [C] task " << m_id << " finished" << std::endl;
+        ASYNCRT_TRACE(Task, Debug, "task ", m_id, " finished");
         break;
     case PollStatus::Pending:
-        std::cout << "+++ [C] task " << m_id << " pending" << std::endl;
+        ASYNCRT_TRACE(Task, Debug, "task ", m_id, " pending");
         break;
     case PollStatus::Panicked:
-        std::cout << "+++ [C] task " << m_id << " panicked" << std::endl;
+        ASYNCRT_TRACE(Task, Warning, "task ", m_id, " panicked");
         break;
     }
-    return status != PollStatus::Pending;
+    return status;
+}
+
+void TaskBase::wake() {
+    if (schedule()) {
+        m_scheduled_ns = detail::now_ns();
+        m_executor.ready(*this);
+    }
+}
+
+std::size_t TaskBase::poll_budget() const noexcept {
+    return m_executor.m_poll_budget;
+}
+
+void TaskBase::yield_budget() {
+    m_executor.local_metrics().budget_yields.fetch_add(1, std::memory_order_relaxed);
+    wake();
+}
+
+void TaskBase::release() noexcept {
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        m_executor.free(*this);
+    }
+}
+
+void TaskBase::cancel() {
+    ASYNCRT_TRACE(Task, Debug, "cancelling task ", m_id);
+    m_cancelled.store(true, std::memory_order_release);
+    wake();
+}
+
+bool TaskBase::try_acquire() noexcept {
+    auto refs = m_refs.load(std::memory_order_relaxed);
+    while (refs != 0) {
+        if (m_refs.compare_exchange_weak(refs, refs + 1, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TaskBase::schedule() noexcept {
+    auto state = m_state.load(std::memory_order_relaxed);
+    while (true) {
+        if ((state & (kScheduled | kNotified | kCompleted)) != 0) {
+            // already queued, queued again after the current poll, or finished
+            return false;
+        }
+        auto next = (state & kRunning) != 0 ? state | kNotified : state | kScheduled;
+        if (m_state.compare_exchange_weak(state, next, std::memory_order_acq_rel)) {
+            return (next & kScheduled) != 0;
+        }
+    }
+}
+
+void TaskBase::begin_poll() noexcept {
+    m_state.store(kRunning, std::memory_order_release);
+}
+
+void TaskBase::complete() noexcept {
+    m_state.store(kCompleted, std::memory_order_release);
+}
+
+bool TaskBase::end_poll() noexcept {
+    auto state = m_state.load(std::memory_order_acquire);
+    while (true) {
+        auto next = (state & kNotified) != 0 ? kScheduled : 0;
+        if (m_state.compare_exchange_weak(state, next, std::memory_order_acq_rel)) {
+            return next == kScheduled;
+        }
+    }
+}
+
+void ReadyQueue::push(TaskBase& task) noexcept {
+    auto* head = m_incoming.load(std::memory_order_relaxed);
+    do {
+        task.m_next_ready = head;
+    } while (!m_incoming.compare_exchange_weak(head, &task, std::memory_order_release,
+                                               std::memory_order_relaxed));
+}
+
+TaskBase* ReadyQueue::pop() noexcept {
+    auto* task = m_head;
+    if (task != nullptr) {
+        m_head = task->m_next_ready;
+        task->m_next_ready = nullptr;
+        if (m_head == nullptr) {
+            m_tail = nullptr;
+        }
+    }
+    return task;
+}
+
+bool ReadyQueue::collect() noexcept {
+    auto* incoming = m_incoming.exchange(nullptr, std::memory_order_acquire);
+    if (incoming == nullptr) {
+        return false;
+    }
+    // reverse the pushed tasks and append them to the collected ones
+    auto* last = incoming;
+    TaskBase* reversed = nullptr;
+    while (incoming != nullptr) {
+        auto* next = incoming->m_next_ready;
+        incoming->m_next_ready = reversed;
+        reversed = incoming;
+        incoming = next;
+    }
+    if (m_head == nullptr) {
+        m_head = reversed;
+    } else {
+        m_tail->m_next_ready = reversed;
+    }
+    m_tail = last;
+    return true;
 }
 
 }  // namespace detail
 
-Executor::Executor(boost::asio::io_context& ioCtx) : m_ioctx{ioCtx} {}
+Executor::Executor(boost::asio::io_context& ioCtx, ExecutorOptions options)
+    : m_ioctx{ioCtx},
+      m_max_polls_per_tick{std::max<std::size_t>(options.max_polls_per_tick, 1)},
+      m_poll_budget{std::max<std::size_t>(options.poll_budget, 1)},
+      m_starvation_threshold_ns{
+          std::chrono::duration_cast<std::chrono::nanoseconds>(options.starvation_threshold)
+              .count()},
+      m_timers{ioCtx},
+      m_metrics{options.worker_threads + 1} {
+    if (options.worker_threads > 0) {
+        m_pool = std::make_unique<detail::WorkerPool>(
+            options.worker_threads, [this](detail::TaskBase& task) { run(task); },
+            m_max_polls_per_tick);
+    }
+}
+
+Executor::~Executor() {
+    // join the workers before the tasks are destroyed
+    m_pool.reset();
+    // Drop the futures of unfinished tasks first, so the wakers they hold are released. Wakers
+    // which are still held by someone else must not be used after the executor is gone.
+    m_tasks.for_each([](detail::TaskBase& task) {
+        if (task.m_state.load(std::memory_order_acquire) != detail::TaskBase::kCompleted) {
+            task.complete();
+            task.drop_future();
+        }
+    });
+}
 
 void Executor::ready(detail::TaskBase& task) {
-    std::cout << "+++ [C] task " << task.get_id() << " became ready" << std::endl;
-    // use post instead of dispatch, because the AsyncFuture may hold a lock
-    // this should probably be redesigned, but it works for now
-    m_ioctx.post([this, &task]() {
-        bool done = task.poll(*this);
-        if (done) {
-            std::cout << "+++ [C] removing task " << task.get_id() << " from runtime" << std::endl;
-            auto task_id = task.get_id();
-            auto begin = std::begin(m_tasks);
-            auto end = std::end(m_tasks);
-            auto iter = std::find_if(
-                begin, end, [task_id](auto const& task) { return task->get_id() == task_id; });
-            if (iter == end) {
-                std::stringstream s;
-                s << "task " << task_id << " not known";
-                throw std::logic_error{s.str()};
+    ASYNCRT_TRACE(Executor, Debug, "task ", task.get_id(), " became ready");
+    local_metrics().wakes.fetch_add(1, std::memory_order_relaxed);
+    if (m_pool) {
+        m_pool->submit(task);
+        return;
+    }
+    m_ready_depth.fetch_add(1, std::memory_order_relaxed);
+    m_ready.push(task);
+    // Poll from a handler instead of polling directly, because the waker may be called from within
+    // other callbacks, e.g. while a Promise is being satisfied. One handler polls all tasks which
+    // became ready in the meantime.
+    if (!m_drain_posted.exchange(true, std::memory_order_acq_rel)) {
+        boost::asio::post(m_ioctx, [this]() { drain(); });
+    }
+}
+
+void Executor::cancel(TaskId id) {
+    detail::TaskBase* task;
+    {
+        std::lock_guard lock{m_mutex};
+        task = m_tasks.get(id);
+        // the task may be about to be freed by its last waker
+        if (task == nullptr || !task->try_acquire()) {
+            return;
+        }
+    }
+    task->cancel();
+    task->release();
+}
+
+void Executor::drain() {
+    // Tasks woken while this handler runs are only collected by the next one, so a task which
+    // keeps waking itself is polled once per handler.
+    m_ready.collect();
+    for (std::size_t polls = 0; polls < m_max_polls_per_tick; ++polls) {
+        auto* task = m_ready.pop();
+        if (task == nullptr) {
+            break;
+        }
+        m_ready_depth.fetch_sub(1, std::memory_order_relaxed);
+        run(*task);
+    }
+    if (!m_ready.empty()) {
+        // the budget is used up, let the io_context run the handlers queued in the meantime
+        local_metrics().budget_yields.fetch_add(1, std::memory_order_relaxed);
+        boost::asio::post(m_ioctx, [this]() { drain(); });
+        return;
+    }
+    m_drain_posted.store(false, std::memory_order_release);
+    // tasks pushed after the last collect() did not post a handler, so they are handled here
+    if (m_ready.collect() && !m_drain_posted.exchange(true, std::memory_order_acq_rel)) {
+        boost::asio::post(m_ioctx, [this]() { drain(); });
+    }
+}
+
+void Executor::run(detail::TaskBase& task) {
+    auto& metrics = local_metrics();
+    auto start_ns = detail::now_ns();
+    metrics.polls.fetch_add(1, std::memory_order_relaxed);
+    auto waited_ns = start_ns - task.m_scheduled_ns;
+    metrics.wake_to_poll_ns.record(static_cast<std::uint64_t>(waited_ns));
+    if (waited_ns > m_starvation_threshold_ns) {
+        metrics.starved_polls.fetch_add(1, std::memory_order_relaxed);
+    }
+    ++task.m_polls;
+
+    task.begin_poll();
+    if (task.m_cancelled.load(std::memory_order_acquire)) {
+        ASYNCRT_TRACE(Executor, Debug, "task ", task.get_id(), " was cancelled");
+        metrics.tasks_cancelled.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        auto status = task.poll(*this);
+        if (status == PollStatus::Pending) {
+            if (task.end_poll()) {
+                // woken while it was polled
+                task.m_scheduled_ns = detail::now_ns();
+                ready(task);
             }
-            m_tasks.erase(iter);
+            return;
         }
-    });
+        if (task.m_expired) {
+            // a missed deadline would skew the completion latencies
+            metrics.tasks_expired.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            auto& finished =
+                status == PollStatus::Ready ? metrics.tasks_completed : metrics.tasks_panicked;
+            finished.fetch_add(1, std::memory_order_relaxed);
+            metrics.spawn_to_complete_ns.record(
+                static_cast<std::uint64_t>(detail::now_ns() - task.m_spawned_ns));
+            metrics.polls_per_task.record(task.m_polls);
+        }
+    }
+
+    ASYNCRT_TRACE(Executor, Debug, "removing task ", task.get_id(), " from runtime");
+    task.complete();
+    // drops the wakers held by the future, too
+    task.drop_future();
+
+    std::lock_guard lock{m_mutex};
+    if (--m_active == 0) {
+        // Releasing the work directly would stop the io_context if it is not running yet,
+        // so release it from a handler instead.
+        boost::asio::post(m_ioctx, [work = std::move(*m_work)]() {});
+        m_work.reset();
+    }
+    if (task.m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        m_tasks.erase(task.get_id());
+    }
+}
+
+void Executor::free(detail::TaskBase& task) noexcept {
+    std::lock_guard lock{m_mutex};
+    m_tasks.erase(task.get_id());
+}
+
+MetricsSnapshot Executor::metrics() const {
+    auto snapshot = m_metrics.snapshot();
+    {
+        std::lock_guard lock{m_mutex};
+        snapshot.tasks_active = m_active;
+        snapshot.tasks_lingering = m_tasks.size() - m_active;
+    }
+    snapshot.queue_depth =
+        m_pool ? m_pool->queued() : m_ready_depth.load(std::memory_order_relaxed);
+    if (m_pool) {
+        snapshot.budget_yields += m_pool->budget_yields();
+    }
+    snapshot.timers_pending = m_timers.pending();
+    snapshot.timers_expired = m_timers.expired();
+    snapshot.pool = pool_stats();
+    return snapshot;
+}
+
+detail::MetricsShard& Executor::local_metrics() noexcept {
+    if (m_pool) {
+        if (auto worker = m_pool->current_worker()) {
+            return m_metrics.shard(*worker + 1);
+        }
+    }
+    return m_metrics.shard(0);
+}
+
+void TaskHandle::cancel() const {
+    if (m_executor != nullptr) {
+        m_executor->cancel(m_id);
+    }
 }
 
 }  // namespace asyncrt
@@ -0,0 +1,79 @@
+#include "TaskTable.hpp"
+#include "Runtime.hpp"
+
+#include <ostream>
+#include <stdexcept>
+
+namespace asyncrt {
+
+std::ostream& operator<<(std::ostream& os, TaskId id) {
+    return os << id.index() << ':' << id.generation();
+}
+
+namespace detail {
+
+TaskTable::~TaskTable() {
+    for (std::uint32_t index = 0; index < m_capacity; ++index) {
+        auto& slot = get_slot(index);
+        if (slot.task != nullptr) {
+            destroy(slot);
+        }
+    }
+}
+
+TaskBase* TaskTable::get(TaskId id) const noexcept {
+    if (id.index() >= m_capacity) {
+        return nullptr;
+    }
+    auto const& slot = get_slot(id.index());
+    if (slot.generation != id.generation()) {
+        return nullptr;
+    }
+    return slot.task;
+}
+
+void TaskTable::erase(TaskId id) noexcept {
+    if (get(id) == nullptr) {
+        return;
+    }
+    destroy(get_slot(id.index()));
+    release_slot(id.index());
+    --m_size;
+}
+
+std::uint32_t TaskTable::acquire_slot() {
+    if (m_free_head != kNoSlot) {
+        auto index = m_free_head;
+        m_free_head = get_slot(index).next_free;
+        return index;
+    }
+    if (m_capacity == kNoSlot) {
+        throw std::length_error{"task table is full"};
+    }
+    if (m_capacity == m_chunks.size() * kChunkSize) {
+        m_chunks.emplace_back(std::make_unique<Slot[]>(kChunkSize));
+    }
+    return m_capacity++;
+}
+
+void TaskTable::release_slot(std::uint32_t index) noexcept {
+    auto& slot = get_slot(index);
+    slot.task = nullptr;
+    // skip generation 0 on wrap-around, it is reserved for invalid ids
+    if (++slot.generation == 0) {
+        slot.generation = 1;
+    }
+    slot.next_free = m_free_head;
+    m_free_head = index;
+}
+
+void TaskTable::destroy(Slot& slot) noexcept {
+    if (slot.is_inline) {
+        slot.task->~TaskBase();
+    } else {
+        delete slot.task;
+    }
+}
+
+}  // namespace detail
+}  // namespace asyncrt
@@ -0,0 +1,274 @@
+#include "TimerWheel.hpp"
+#include "Pool.hpp"
+#include "Runtime.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <bit>
+
+#include <boost/asio/post.hpp>
+
+namespace asyncrt {
+namespace detail {
+namespace {
+
+// Future of TimerWheel::sleep_until(), the wheel wakes the waker of the latest poll.
+class SleepFuture : public PoolAllocated {
+public:
+    SleepFuture(TimerWheel& wheel, TimerWheel::Clock::time_point deadline)
+        : m_wheel{wheel}, m_entry{deadline} {}
+
+    static ::FfiPoll<bool> poll(void* self, ::FfiContext* context) {
+        auto* future = static_cast<SleepFuture*>(self);
+        try {
+            if (future->m_wheel.poll(future->m_entry, context)) {
+                return make_poll_status<bool>(true);
+            }
+            return make_poll_status<bool>(PollStatus::Pending);
+        } catch (...) {
+            return make_poll_status<bool>(PollStatus::Panicked);
+        }
+    }
+
+    static void drop(void* self) {
+        auto* future = static_cast<SleepFuture*>(self);
+        future->m_wheel.cancel(future->m_entry);
+        delete future;
+    }
+
+private:
+    TimerWheel& m_wheel;
+    TimerEntry m_entry;
+};
+
+}  // namespace
+
+TimerWheel::TimerWheel(boost::asio::io_context& ioctx)
+    : m_ioctx{ioctx}, m_timer{ioctx}, m_start{Clock::now()} {}
+
+bool TimerWheel::poll(TimerEntry& entry, ::FfiContext* context) {
+    if (entry.expired()) {
+        return true;
+    }
+    auto now = Clock::now();
+    auto passed = entry.m_deadline <= now;
+    ::FfiWakerBase const* waker = nullptr;
+    if (!passed) {
+        waker = context->waker->vtable->clone(context->waker);
+    }
+    ::FfiWakerBase const* previous = nullptr;
+    {
+        std::lock_guard lock{m_mutex};
+        if (entry.m_expired.load(std::memory_order_relaxed)) {
+            // expired by the timer in the meantime, which took the previous waker
+            passed = true;
+        } else if (passed) {
+            if (entry.m_slot != TimerEntry::kUnlinked) {
+                unlink(entry);
+                ++m_expired;
+            }
+            previous = std::exchange(entry.m_waker, nullptr);
+            entry.m_expired.store(true, std::memory_order_release);
+        } else {
+            previous = std::exchange(entry.m_waker, std::exchange(waker, nullptr));
+            if (entry.m_slot == TimerEntry::kUnlinked) {
+                if (m_pending == 0) {
+                    // nothing depends on the elapsed tick, so catch up after idling
+                    m_elapsed = std::max(m_elapsed, current_tick(now));
+                }
+                entry.m_tick = deadline_tick(entry.m_deadline);
+                link(entry);
+                if (entry.m_tick < m_armed) {
+                    request_arm();
+                }
+            }
+        }
+    }
+    for (auto const* unused : {previous, waker}) {
+        if (unused != nullptr) {
+            unused->vtable->drop(unused);
+        }
+    }
+    return passed;
+}
+
+void TimerWheel::cancel(TimerEntry& entry) noexcept {
+    ::FfiWakerBase const* waker = nullptr;
+    {
+        std::lock_guard lock{m_mutex};
+        if (entry.m_slot == TimerEntry::kUnlinked) {
+            // never registered, or expired
+            return;
+        }
+        unlink(entry);
+        waker = std::exchange(entry.m_waker, nullptr);
+        if (m_pending == 0 && m_armed != kNever) {
+            // disarm the timer, so it does not keep the io_context running
+            request_arm();
+        }
+    }
+    waker->vtable->drop(waker);
+}
+
+::FfiFuture<bool> TimerWheel::sleep_until(Clock::time_point deadline) {
+    auto* future = new SleepFuture{*this, deadline};
+    return ::FfiFuture<bool>{future, &SleepFuture::poll, &SleepFuture::drop};
+}
+
+std::size_t TimerWheel::pending() const {
+    std::lock_guard lock{m_mutex};
+    return m_pending;
+}
+
+std::uint64_t TimerWheel::expired() const {
+    std::lock_guard lock{m_mutex};
+    return m_expired;
+}
+
+std::uint64_t TimerWheel::deadline_tick(Clock::time_point deadline) const noexcept {
+    auto ticks = std::chrono::ceil<std::chrono::milliseconds>(deadline - m_start).count();
+    return static_cast<std::uint64_t>(std::max<std::int64_t>(ticks, 0));
+}
+
+std::uint64_t TimerWheel::current_tick(Clock::time_point now) const noexcept {
+    auto ticks = std::chrono::floor<std::chrono::milliseconds>(now - m_start).count();
+    return static_cast<std::uint64_t>(std::max<std::int64_t>(ticks, 0));
+}
+
+TimerWheel::Clock::time_point TimerWheel::time_of(std::uint64_t tick) const noexcept {
+    return m_start + std::chrono::milliseconds{tick};
+}
+
+void TimerWheel::link(TimerEntry& entry) noexcept {
+    entry.m_tick = std::max(entry.m_tick, m_elapsed + 1);
+    // The entry goes to the lowest level at which its tick is in the same window as the elapsed
+    // tick, so every level only holds entries due after those of the levels below.
+    auto level = (std::bit_width(entry.m_tick ^ m_elapsed) - 1) / kSlotBits;
+    std::uint16_t index = kOverflow;
+    if (level < kLevels) {
+        auto slot = (entry.m_tick >> (level * kSlotBits)) & (kSlots - 1);
+        m_occupied[level] |= std::uint64_t{1} << slot;
+        index = static_cast<std::uint16_t>(level * kSlots + slot);
+    }
+    entry.m_slot = index;
+    entry.m_prev = nullptr;
+    entry.m_next = m_lists[index];
+    if (entry.m_next != nullptr) {
+        entry.m_next->m_prev = &entry;
+    }
+    m_lists[index] = &entry;
+    ++m_pending;
+}
+
+void TimerWheel::unlink(TimerEntry& entry) noexcept {
+    auto index = entry.m_slot;
+    if (entry.m_prev != nullptr) {
+        entry.m_prev->m_next = entry.m_next;
+    } else {
+        m_lists[index] = entry.m_next;
+    }
+    if (entry.m_next != nullptr) {
+        entry.m_next->m_prev = entry.m_prev;
+    }
+    if (m_lists[index] == nullptr && index < kOverflow) {
+        m_occupied[index / kSlots] &= ~(std::uint64_t{1} << (index % kSlots));
+    }
+    entry.m_prev = nullptr;
+    entry.m_next = nullptr;
+    entry.m_slot = TimerEntry::kUnlinked;
+    --m_pending;
+}
+
+std::optional<std::pair<std::uint16_t, std::uint64_t>> TimerWheel::next_due() const noexcept {
+    for (std::size_t level = 0; level < kLevels; ++level) {
+        if (m_occupied[level] == 0) {
+            continue;
+        }
+        // all occupied slots come after the slot of the elapsed tick
+        auto slot = static_cast<std::uint64_t>(std::countr_zero(m_occupied[level]));
+        auto shift = level * kSlotBits;
+        auto window = m_elapsed >> (shift + kSlotBits) << (shift + kSlotBits);
+        return std::pair{static_cast<std::uint16_t>(level * kSlots + slot),
+                         window | (slot << shift)};
+    }
+    if (m_lists[kOverflow] != nullptr) {
+        // the overflow entries are placed again once the next window of the top level starts
+        auto shift = kLevels * kSlotBits;
+        return std::pair{kOverflow, ((m_elapsed >> shift) + 1) << shift};
+    }
+    return std::nullopt;
+}
+
+void TimerWheel::advance(std::uint64_t now, std::vector<::FfiWakerBase const*>& woken) {
+    while (auto due = next_due()) {
+        auto [index, tick] = *due;
+        if (tick > now) {
+            break;
+        }
+        m_elapsed = tick;
+        auto* entry = m_lists[index];
+        while (entry != nullptr) {
+            auto* next = entry->m_next;
+            unlink(*entry);
+            if (entry->m_tick <= now) {
+                woken.push_back(std::exchange(entry->m_waker, nullptr));
+                entry->m_expired.store(true, std::memory_order_release);
+            } else {
+                // moves down to a lower level
+                link(*entry);
+            }
+            entry = next;
+        }
+    }
+    m_elapsed = std::max(m_elapsed, now);
+}
+
+void TimerWheel::arm() {
+    auto due = next_due();
+    auto tick = due ? due->second : kNever;
+    if (tick == m_armed) {
+        return;
+    }
+    m_armed = tick;
+    if (tick == kNever) {
+        m_timer.cancel();
+        return;
+    }
+    // replaces the pending wait, if any
+    m_timer.expires_at(time_of(tick));
+    m_timer.async_wait([this](boost::system::error_code const& error) {
+        if (error != boost::asio::error::operation_aborted) {
+            on_timer();
+        }
+    });
+}
+
+void TimerWheel::request_arm() {
+    if (m_arm_posted) {
+        return;
+    }
+    m_arm_posted = true;
+    boost::asio::post(m_ioctx, [this]() {
+        std::lock_guard lock{m_mutex};
+        m_arm_posted = false;
+        arm();
+    });
+}
+
+void TimerWheel::on_timer() {
+    std::vector<::FfiWakerBase const*> woken{};
+    {
+        std::lock_guard lock{m_mutex};
+        m_armed = kNever;
+        advance(current_tick(Clock::now()), woken);
+        m_expired += woken.size();
+        arm();
+    }
+    ASYNCRT_TRACE(Executor, Debug, "timer wheel woke ", woken.size(), " tasks");
+    for (auto const* waker : woken) {
+        waker->vtable->wake(waker);
+    }
+}
+
+}  // namespace detail
+}  // namespace asyncrt
@@ -0,0 +1,166 @@
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+
+namespace asyncrt {
+namespace trace {
+namespace {
+
+constexpr std::size_t kRingSize = 4096;
+
+// A line in the ring buffer. The sequence number is odd while the record is written, readers
+// retry or skip records whose sequence number changed while they copied them.
+struct Record {
+    std::atomic<std::uint64_t> sequence{0};
+    std::int64_t time_ns{0};
+    Category category{};
+    Level level{};
+    std::uint8_t length{0};
+    char line[detail::kLineSize]{};
+};
+
+struct Ring {
+    std::atomic<std::uint64_t> next{0};
+    std::uint64_t dumped{0};
+    std::mutex dump_mutex{};
+    std::array<Record, kRingSize> records{};
+};
+
+std::atomic<Sink> g_sink{Sink::Stderr};
+
+Ring& get_ring() {
+    static auto ring = std::make_unique<Ring>();
+    return *ring;
+}
+
+std::int64_t now_ns() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void write_ring(Category category, Level level, std::string_view line) noexcept {
+    auto& ring = get_ring();
+    auto index = ring.next.fetch_add(1, std::memory_order_relaxed);
+    auto& record = ring.records[index % kRingSize];
+    record.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.time_ns = now_ns();
+    record.category = category;
+    record.level = level;
+    record.length = static_cast<std::uint8_t>(line.copy(record.line, sizeof(record.line)));
+    record.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+void write_stderr(Category category, std::string_view line) noexcept {
+    // build the whole line first, so concurrent lines are not interleaved
+    char buffer[detail::kLineSize + 32];
+    auto length = std::snprintf(buffer, sizeof(buffer), "+++ [C] [%.*s] %.*s\n",
+                                static_cast<int>(to_string(category).size()),
+                                to_string(category).data(), static_cast<int>(line.size()),
+                                line.data());
+    if (length > 0) {
+        std::fwrite(buffer, 1, std::min(sizeof(buffer) - 1, static_cast<std::size_t>(length)),
+                    stderr);
+    }
+}
+
+}  // namespace
+
+std::string_view to_string(Level level) noexcept {
+    switch (level) {
+    case Level::Debug:
+        return "debug";
+    case Level::Info:
+        return "info";
+    case Level::Warning:
+        return "warning";
+    case Level::Error:
+        return "error";
+    }
+    return "unknown";
+}
+
+std::string_view to_string(Category category) noexcept {
+    switch (category) {
+    case Category::Executor:
+        return "executor";
+    case Category::Task:
+        return "task";
+    case Category::Waker:
+        return "waker";
+    case Category::Future:
+        return "future";
+    case Category::Data:
+        return "data";
+    }
+    return "unknown";
+}
+
+void set_level(Level level) noexcept {
+    detail::g_level.store(level, std::memory_order_relaxed);
+}
+
+void enable(Category category, bool enabled) noexcept {
+    auto bit = std::uint32_t{1} << static_cast<unsigned>(category);
+    if (enabled) {
+        detail::g_categories.fetch_or(bit, std::memory_order_relaxed);
+    } else {
+        detail::g_categories.fetch_and(~bit, std::memory_order_relaxed);
+    }
+}
+
+void set_sink(Sink sink) {
+    if (sink == Sink::Ring) {
+        // allocate the buffer before the first line is written into it
+        get_ring();
+    }
+    g_sink.store(sink, std::memory_order_release);
+}
+
+void dump(std::ostream& os) {
+    auto& ring = get_ring();
+    std::lock_guard lock{ring.dump_mutex};
+    auto end = ring.next.load(std::memory_order_acquire);
+    auto begin = std::max(ring.dumped, end > kRingSize ? end - kRingSize : 0);
+    for (auto index = begin; index < end; ++index) {
+        auto const& record = ring.records[index % kRingSize];
+        auto sequence = record.sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * index + 2) {
+            // still being written, or already overwritten
+            continue;
+        }
+        auto time_ns = record.time_ns;
+        auto category = record.category;
+        auto level = record.level;
+        char line[detail::kLineSize];
+        auto length = std::string_view{record.line, record.length}.copy(line, sizeof(line));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (record.sequence.load(std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+        os << time_ns << " [" << to_string(category) << "] " << to_string(level) << ": "
+           << std::string_view{line, length} << '\n';
+    }
+    ring.dumped = end;
+}
+
+namespace detail {
+
+void emit(Category category, Level level, std::string_view line) noexcept {
+    if (g_sink.load(std::memory_order_acquire) == Sink::Ring) {
+        write_ring(category, level, line);
+    } else {
+        write_stderr(category, line);
+    }
+}
+
+}  // namespace detail
+}  // namespace trace
+}  // namespace asyncrt
@@ -0,0 +1,145 @@
+#include "WorkerPool.hpp"
+
+#include <stdexcept>
+
+namespace asyncrt {
+namespace detail {
+namespace {
+
+// the pool and queue index of the current thread, if it is a worker
+thread_local WorkerPool const* t_pool = nullptr;
+thread_local std::size_t t_index = 0;
+
+}  // namespace
+
+WorkerPool::WorkerPool(std::size_t threads,
+                       std::function<void(TaskBase&)> run,
+                       std::size_t local_budget)
+    : m_run{std::move(run)}, m_local_budget{local_budget} {
+    if (threads == 0) {
+        throw std::invalid_argument{"worker pool needs at least one thread"};
+    }
+    m_workers.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+        m_workers.emplace_back(std::make_unique<Worker>());
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+        m_workers[i]->thread = std::thread{&WorkerPool::work, this, i};
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard lock{m_mutex};
+        m_stopping = true;
+    }
+    m_wakeup.notify_all();
+    for (auto& worker : m_workers) {
+        worker->thread.join();
+    }
+}
+
+std::optional<std::size_t> WorkerPool::current_worker() const noexcept {
+    if (t_pool != this) {
+        return std::nullopt;
+    }
+    return t_index;
+}
+
+void WorkerPool::submit(TaskBase& task) {
+    if (t_pool == this) {
+        auto& worker = *m_workers[t_index];
+        {
+            std::lock_guard lock{worker.mutex};
+            worker.queue.push_back(&task);
+            m_queued.fetch_add(1, std::memory_order_release);
+        }
+        // synchronize with workers which are about to sleep, so the wake-up is not lost
+        std::lock_guard lock{m_mutex};
+    } else {
+        std::lock_guard lock{m_mutex};
+        m_injected.push_back(&task);
+        m_queued.fetch_add(1, std::memory_order_release);
+    }
+    m_wakeup.notify_one();
+}
+
+void WorkerPool::work(std::size_t index) {
+    t_pool = this;
+    t_index = index;
+    while (true) {
+        if (auto* task = next(index)) {
+            m_run(*task);
+            continue;
+        }
+        std::unique_lock lock{m_mutex};
+        m_wakeup.wait(lock, [this]() {
+            return m_stopping || m_queued.load(std::memory_order_acquire) > 0;
+        });
+        if (m_stopping) {
+            return;
+        }
+    }
+}
+
+TaskBase* WorkerPool::next(std::size_t index) {
+    auto& worker = *m_workers[index];
+    if (worker.local_runs >= m_local_budget) {
+        worker.local_runs = 0;
+        if (auto* task = take_injected()) {
+            m_budget_yields.fetch_add(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    {
+        std::lock_guard lock{worker.mutex};
+        if (!worker.queue.empty()) {
+            auto* task = worker.queue.front();
+            worker.queue.pop_front();
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            ++worker.local_runs;
+            return task;
+        }
+    }
+    worker.local_runs = 0;
+    if (auto* task = take_injected()) {
+        return task;
+    }
+    return steal(index);
+}
+
+TaskBase* WorkerPool::take_injected() {
+    std::lock_guard lock{m_mutex};
+    if (m_injected.empty()) {
+        return nullptr;
+    }
+    auto* task = m_injected.front();
+    m_injected.pop_front();
+    m_queued.fetch_sub(1, std::memory_order_relaxed);
+    return task;
+}
+
+TaskBase* WorkerPool::steal(std::size_t index) {
+    auto& thief = *m_workers[index];
+    for (std::size_t i = 1; i < m_workers.size(); ++i) {
+        auto& victim = *m_workers[(index + i) % m_workers.size()];
+        std::scoped_lock lock{thief.mutex, victim.mutex};
+        if (victim.queue.empty()) {
+            continue;
+        }
+        // take the older half of the victim's queue, run the first and keep the rest
+        auto count = (victim.queue.size() + 1) / 2;
+        auto* task = victim.queue.front();
+        victim.queue.pop_front();
+        for (std::size_t n = 1; n < count; ++n) {
+            thief.queue.push_back(victim.queue.front());
+            victim.queue.pop_front();
+        }
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+    }
+    return nullptr;
+}
+
+}  // namespace detail
+}  // namespace asyncrt
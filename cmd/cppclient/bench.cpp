@@ -0,0 +1,120 @@
+// Microbenchmarks for the FFI round-trip between the executor and Rust futures.
+//
+// Every scenario keeps a fixed number of tasks in flight until the given number of tasks was
+// spawned, and reports throughput, the cost of a single poll and the wake-to-poll latency.
+
+#include "Metrics.hpp"
+#include "Runtime.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+#include "ffi/future.h"
+
+extern "C" {
+
+::FfiFuture<std::uint64_t> mylib_bench_ready(std::uint64_t value);
+::FfiFuture<std::uint64_t> mylib_bench_pending(std::uint32_t count);
+::FfiFuture<std::uint64_t> mylib_bench_wake_from_thread(std::uint32_t count);
+
+}  // extern "C"
+
+namespace asio = boost::asio;
+
+namespace {
+
+struct Scenario {
+    std::string_view name;
+    std::size_t workers;
+    std::size_t concurrency;
+    std::size_t tasks;
+    std::function<::FfiFuture<std::uint64_t>()> make_future;
+};
+
+void run(Scenario const& scenario) {
+    asio::io_context io_context{};
+    asyncrt::Executor executor{io_context, {.worker_threads = scenario.workers}};
+
+    std::atomic<std::size_t> spawned{0};
+    std::function<void()> spawn = [&]() {
+        if (spawned.fetch_add(1, std::memory_order_relaxed) >= scenario.tasks) {
+            return;
+        }
+        // Spawn the replacement from a handler, so single-threaded executors do not recurse
+        // into the next task while completing the previous one.
+        executor.await(asyncrt::RustFuture{scenario.make_future()},
+                       [&](std::uint64_t const&) { asio::post(io_context, spawn); });
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    asio::post(io_context, [&]() {
+        for (std::size_t i = 0; i < scenario.concurrency; ++i) {
+            spawn();
+        }
+    });
+    io_context.run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // wakers may still be released on the Rust side, they must not outlive the executor
+    auto metrics = executor.metrics();
+    while (metrics.tasks_lingering > 0) {
+        std::this_thread::yield();
+        metrics = executor.metrics();
+    }
+
+    auto polls = metrics.polls == 0 ? 1 : metrics.polls;
+    std::cout << std::left << std::setw(18) << scenario.name << std::right << std::setw(8)
+              << scenario.workers << std::setw(12) << scenario.concurrency << std::setw(10)
+              << metrics.tasks_completed << std::fixed << std::setprecision(0) << std::setw(14)
+              << static_cast<double>(metrics.tasks_completed) / elapsed.count() << std::setw(12)
+              << elapsed.count() * 1e9 / static_cast<double>(polls) << std::setw(12)
+              << metrics.wake_to_poll_ns.quantile(0.5) << std::setw(12)
+              << metrics.wake_to_poll_ns.quantile(0.99) << '\n';
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        // optional argument: number of tasks per scenario
+        std::size_t tasks = 100'000;
+        if (argc > 1) {
+            tasks = std::stoul(argv[1]);
+        }
+        constexpr std::uint32_t kPendingPolls = 16;
+
+        std::cout << std::left << std::setw(18) << "scenario" << std::right << std::setw(8)
+                  << "workers" << std::setw(12) << "concurrency" << std::setw(10) << "tasks"
+                  << std::setw(14) << "tasks/s" << std::setw(12) << "ns/poll" << std::setw(12)
+                  << "wake p50" << std::setw(12) << "wake p99" << '\n';
+
+        for (std::size_t workers : {0, 1, 4}) {
+            for (std::size_t concurrency : {1, 64, 1024}) {
+                run({"spawn", workers, concurrency, tasks, []() { return mylib_bench_ready(1); }});
+            }
+            for (std::size_t concurrency : {1, 64, 1024}) {
+                run({"poll", workers, concurrency, tasks / kPendingPolls,
+                     []() { return mylib_bench_pending(kPendingPolls); }});
+            }
+            for (std::size_t concurrency : {1, 64}) {
+                run({"wake-from-thread", workers, concurrency, tasks / kPendingPolls,
+                     []() { return mylib_bench_wake_from_thread(kPendingPolls); }});
+            }
+        }
+        std::cout.flush();
+    } catch (std::exception const& err) {
+        std::cerr << "fatal exception: " << err.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,197 @@
+#include "cache.hpp"
+
+#include <expected>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace mylib {
+namespace detail {
+
+struct Cache {
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        std::string key;
+        std::shared_ptr<SharedData const> data;
+        Clock::time_point fresh_until;
+        bool refreshing{false};
+    };
+
+    explicit Cache(CacheOptions options) : options{options} {}
+
+    // Returns the entry for the key, if it is not too stale to be used, and marks it as used.
+    Entry* find(std::string_view key, Clock::time_point now) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        if (now >= it->second->fresh_until + options.stale_while_revalidate) {
+            erase(it->second);
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &*it->second;
+    }
+
+    void insert(std::string_view key,
+                std::shared_ptr<SharedData const> data,
+                Clock::time_point now) {
+        if (auto it = index.find(key); it != index.end()) {
+            erase(it->second);
+        }
+        if (data->size() > options.max_bytes) {
+            return;
+        }
+        bytes += data->size();
+        entries.push_front(Entry{
+            .key = std::string{key},
+            .data = std::move(data),
+            .fresh_until = now + options.ttl,
+        });
+        index.emplace(entries.front().key, entries.begin());
+        while (bytes > options.max_bytes) {
+            erase(std::prev(entries.end()));
+        }
+    }
+
+    void erase(std::list<Entry>::iterator entry) {
+        bytes -= entry->data->size();
+        index.erase(entry->key);
+        entries.erase(entry);
+    }
+
+    CacheOptions const options;
+    std::mutex mutex{};
+    // most recently used first
+    std::list<Entry> entries{};
+    std::unordered_map<std::string_view, std::list<Entry>::iterator, StringHash, std::equal_to<>>
+        index{};
+    std::size_t bytes{0};
+};
+
+}  // namespace detail
+
+namespace {
+
+::FfiPoll<DataResult> make_shared_poll(std::shared_ptr<SharedData const> data) {
+    return asyncrt::make_poll_status(asyncrt::make_ffi_ok(data->hand_out()));
+}
+
+::FfiFuture<DataResult> make_ready_future(std::shared_ptr<SharedData const> data) {
+    return asyncrt::make_cpp_future<DataResult>(
+        [data = std::move(data)](::FfiContext*) { return make_shared_poll(data); });
+}
+
+// Callback of a background refresh. If the refresh fails, or panics and the executor destroys the
+// callback without calling it, the stale entry is refreshed again on its next use.
+class Refresh {
+public:
+    Refresh(std::weak_ptr<detail::Cache> cache, std::string key)
+        : m_cache{std::move(cache)}, m_key{std::move(key)} {}
+    Refresh(Refresh&&) = default;
+    Refresh(Refresh const&) = delete;
+
+    ~Refresh() {
+        // a moved-from callback has no cache
+        if (!m_cache.expired()) {
+            finish(nullptr);
+        }
+    }
+
+    Refresh& operator=(Refresh&&) = delete;
+    Refresh& operator=(Refresh const&) = delete;
+
+    void operator()(std::expected<::FfiDataHolder, asyncrt::Error> const& result) {
+        if (!result) {
+            ASYNCRT_TRACE(Data, Warning, "cache refresh failed: ", result.error().message());
+            finish(nullptr);
+            return;
+        }
+        finish(share(*result));
+    }
+
+private:
+    void finish(std::shared_ptr<SharedData const> data) {
+        auto cache = std::exchange(m_cache, {}).lock();
+        if (!cache) {
+            return;
+        }
+        auto now = detail::Cache::Clock::now();
+        std::lock_guard lock{cache->mutex};
+        if (data) {
+            cache->insert(m_key, std::move(data), now);
+        } else if (auto* entry = cache->find(m_key, now)) {
+            entry->refreshing = false;
+        }
+    }
+
+    std::weak_ptr<detail::Cache> m_cache;
+    std::string m_key;
+};
+
+}  // namespace
+
+CachingDataAccess::CachingDataAccess(std::unique_ptr<DataAccess> data_access,
+                                     asyncrt::Executor& executor,
+                                     CacheOptions options)
+    : m_data_access{std::move(data_access)},
+      m_executor{executor},
+      m_refresh_timeout{options.refresh_timeout},
+      m_cache{std::make_shared<detail::Cache>(options)} {}
+
+CachingDataAccess::~CachingDataAccess() = default;
+
+::FfiFuture<DataResult> CachingDataAccess::get_data(std::string_view key) {
+    auto now = detail::Cache::Clock::now();
+    std::shared_ptr<SharedData const> data{};
+    bool stale = false;
+    {
+        std::lock_guard lock{m_cache->mutex};
+        if (auto* entry = m_cache->find(key, now)) {
+            data = entry->data;
+            stale = now >= entry->fresh_until && !entry->refreshing;
+            entry->refreshing = entry->refreshing || stale;
+        }
+    }
+    if (data) {
+        if (stale) {
+            refresh(key);
+        }
+        return make_ready_future(std::move(data));
+    }
+
+    // a miss is fetched by the caller, the response is stored when it is ready, errors are passed
+    // on without being cached
+    return asyncrt::make_cpp_future<DataResult>(
+        [future = asyncrt::RustFuture{m_data_access->get_data(key)},
+         cache = std::weak_ptr{m_cache}, key = std::string{key}](::FfiContext* context) mutable {
+            auto poll = future.poll(context);
+            if (poll.status != asyncrt::PollStatus::Ready || poll.value.tag != ::FfiResultTag::Ok) {
+                return poll;
+            }
+            auto data = share(poll.value.ok);
+            if (auto shared_cache = cache.lock()) {
+                std::lock_guard lock{shared_cache->mutex};
+                shared_cache->insert(key, data, detail::Cache::Clock::now());
+            }
+            return make_shared_poll(std::move(data));
+        });
+}
+
+::FfiFuture<bool> CachingDataAccess::sleep(std::chrono::nanoseconds duration) {
+    return m_data_access->sleep(duration);
+}
+
+void CachingDataAccess::refresh(std::string_view key) {
+    // on expiry, the callback is destroyed without being called, which ends the refresh
+    m_executor.await_with_deadline(
+        asyncrt::RustFuture{m_data_access->get_data(key)},
+        std::chrono::steady_clock::now() + m_refresh_timeout, Refresh{m_cache, std::string{key}},
+        []() { ASYNCRT_TRACE(Data, Warning, "cache refresh timed out"); });
+}
+
+}  // namespace mylib
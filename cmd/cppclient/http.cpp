@@ -1,12 +1,20 @@
 #include "http.hpp"
 
+#include <algorithm>
+#include <charconv>
 #include <chrono>
 #include <iostream>
-#include <sstream>
+#include <mutex>
+#include <unordered_map>
 
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/beast/http.hpp>
 
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
 namespace asio = boost::asio;
 namespace beast = boost::beast;
 namespace ssl = asio::ssl;
@@ -15,91 +23,436 @@ namespace http {
 namespace detail {
 namespace {
 
+using SessionPtr = std::unique_ptr<SSL_SESSION, decltype(&SSL_SESSION_free)>;
+
+/**
+ * The latest TLS session per host, so new connections to a host resume it instead of doing a full
+ * handshake. With TLS 1.3, servers send their session tickets after the handshake, so sessions
+ * are stored from the new session callback of the context.
+ */
+class SessionCache {
+public:
+    SessionPtr get(std::string const& host) {
+        std::lock_guard lock{m_mutex};
+        auto it = m_sessions.find(host);
+        if (it == m_sessions.end()) {
+            return {nullptr, &SSL_SESSION_free};
+        }
+        SSL_SESSION_up_ref(it->second.get());
+        return {it->second.get(), &SSL_SESSION_free};
+    }
+
+    void put(std::string const& host, SessionPtr session) {
+        std::lock_guard lock{m_mutex};
+        m_sessions.insert_or_assign(host, std::move(session));
+    }
+
+private:
+    std::mutex m_mutex{};
+    std::unordered_map<std::string, SessionPtr> m_sessions{};
+};
+
+SessionCache& get_session_cache() {
+    static SessionCache session_cache{};
+    return session_cache;
+}
+
+// index of the Connection in the ex data of its SSL object, asio uses the app data itself
+int connection_index() {
+    static int const index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+int on_new_session(SSL* ssl, SSL_SESSION* session) {
+    if (SSL_SESSION_is_resumable(session) == 0) {
+        return 0;
+    }
+    auto const* connection =
+        static_cast<Connection const*>(SSL_get_ex_data(ssl, connection_index()));
+    get_session_cache().put(connection->host, SessionPtr{session, &SSL_SESSION_free});
+    // the cache took over the reference
+    return 1;
+}
+
 std::once_flag ssl_init;
 
 void load_certificates(ssl::context& ssl_context) {
     ssl_context.set_verify_mode(ssl::verify_none);
+    auto* native = ssl_context.native_handle();
+    SSL_CTX_set_min_proto_version(native, TLS1_2_VERSION);
+    SSL_CTX_set_session_cache_mode(native,
+                                   SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(native, &on_new_session);
 }
 
 ssl::context& get_ssl_context() {
-    static ssl::context ssl_context{ssl::context::tlsv12_client};
+    // TLS 1.2 and 1.3
+    static ssl::context ssl_context{ssl::context::tls_client};
     std::call_once(ssl_init, load_certificates, ssl_context);
     return ssl_context;
 }
 
+// key of the connections and addresses of a host and port
+std::string get_origin(std::string_view host, std::string_view port) {
+    std::string origin{host};
+    origin += ':';
+    origin += port;
+    return origin;
+}
+
+// Sets the server name and the session to resume, if there is one for the host.
+beast::error_code prepare_handshake(Connection& connection) {
+    auto* ssl = connection.stream.native_handle();
+    if (SSL_set_tlsext_host_name(ssl, connection.host.c_str()) == 0) {
+        return {static_cast<int>(::ERR_get_error()), asio::error::get_ssl_category()};
+    }
+    if (auto session = get_session_cache().get(connection.host)) {
+        SSL_set_session(ssl, session.get());
+    }
+    return {};
+}
+
 }  // namespace
 
-SessionBase::SessionBase(asio::io_context& io_context)
-    : m_resolver{io_context}, m_stream{io_context, get_ssl_context()} {}
+Connection::Connection(Strand const& strand, std::string host, std::string port)
+    : host{std::move(host)},
+      port{std::move(port)},
+      origin{get_origin(this->host, this->port)},
+      stream{strand, get_ssl_context()} {
+    SSL_set_ex_data(stream.native_handle(), connection_index(), this);
+}
+
+ConnectionPool::ConnectionPool(asio::io_context& io_context, PoolOptions options)
+    : m_strand{asio::make_strand(io_context)}, m_options{options} {}
 
-SessionBase::~SessionBase() = default;
+ConnectionPool::~ConnectionPool() = default;
+
+ConnectionPool::Ticket ConnectionPool::acquire(std::string host,
+                                               std::string port,
+                                               Handler handler,
+                                               bool fresh) {
+    auto ticket = m_next_ticket.fetch_add(1, std::memory_order_relaxed);
+    asio::dispatch(m_strand, [self = shared_from_this(), host = std::move(host),
+                              port = std::move(port), ticket, handler = std::move(handler),
+                              fresh]() mutable {
+        self->do_acquire(host, port, ticket, std::move(handler), fresh);
+    });
+    return ticket;
+}
+
+void ConnectionPool::cancel(Ticket ticket) {
+    for (auto& [origin, entry] : m_hosts) {
+        auto it = std::ranges::find(entry.waiting, ticket, &Waiter::ticket);
+        if (it != entry.waiting.end()) {
+            // the handler may hold the last reference to its request
+            auto waiter = std::move(*it);
+            entry.waiting.erase(it);
+            return;
+        }
+    }
+}
+
+void ConnectionPool::release(std::unique_ptr<Connection> connection, bool reusable) {
+    asio::dispatch(m_strand, [self = shared_from_this(), connection = std::move(connection),
+                              reusable]() mutable {
+        self->do_release(std::move(connection), reusable);
+    });
+}
+
+void ConnectionPool::do_acquire(std::string const& host,
+                                std::string const& port,
+                                Ticket ticket,
+                                Handler handler,
+                                bool fresh) {
+    close_expired(std::chrono::steady_clock::now());
+    auto& entry = m_hosts[get_origin(host, port)];
+    if (fresh) {
+        entry.open -= entry.idle.size();
+        entry.idle.clear();
+    } else if (!entry.idle.empty()) {
+        // the most recently used connection is the least likely to be closed by the server
+        auto connection = std::move(entry.idle.back());
+        entry.idle.pop_back();
+        handler(std::move(connection));
+        return;
+    }
+    if (entry.open < m_options.max_per_host) {
+        ++entry.open;
+        handler(std::make_unique<Connection>(m_strand, host, port));
+        return;
+    }
+    entry.waiting.push_back(Waiter{ticket, std::move(handler)});
+}
+
+void ConnectionPool::do_release(std::unique_ptr<Connection> connection, bool reusable) {
+    auto now = std::chrono::steady_clock::now();
+    auto& entry = m_hosts[connection->origin];
+    if (!reusable) {
+        auto host = std::move(connection->host);
+        auto port = std::move(connection->port);
+        connection.reset();
+        --entry.open;
+        if (!entry.waiting.empty()) {
+            auto handler = std::move(entry.waiting.front().handler);
+            entry.waiting.pop_front();
+            ++entry.open;
+            handler(std::make_unique<Connection>(m_strand, std::move(host), std::move(port)));
+        }
+    } else if (!entry.waiting.empty()) {
+        auto handler = std::move(entry.waiting.front().handler);
+        entry.waiting.pop_front();
+        handler(std::move(connection));
+    } else if (entry.idle.size() < m_options.max_idle_per_host) {
+        connection->idle_since = now;
+        entry.idle.push_back(std::move(connection));
+    } else {
+        connection.reset();
+        --entry.open;
+    }
+    close_expired(now);
+}
+
+void ConnectionPool::close_expired(std::chrono::steady_clock::time_point now) {
+    for (auto it = m_hosts.begin(); it != m_hosts.end();) {
+        auto& entry = it->second;
+        // idle connections are ordered by the time they were released
+        while (!entry.idle.empty() &&
+               now - entry.idle.front()->idle_since >= m_options.idle_timeout) {
+            entry.idle.pop_front();
+            --entry.open;
+        }
+        if (entry.open == 0 && entry.waiting.empty()) {
+            it = m_hosts.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+ResolverCache::ResolverCache(Strand const& strand, ResolverOptions options)
+    : m_strand{strand}, m_options{options}, m_resolver{strand} {}
+
+ResolverCache::~ResolverCache() = default;
+
+void ResolverCache::resolve(std::string host, std::string port, Handler handler) {
+    asio::dispatch(m_strand, [self = shared_from_this(), host = std::move(host),
+                              port = std::move(port), handler = std::move(handler)]() mutable {
+        self->do_resolve(host, port, std::move(handler));
+    });
+}
+
+void ResolverCache::invalidate(std::string const& host, std::string const& port) {
+    asio::dispatch(m_strand, [self = shared_from_this(), origin = get_origin(host, port)]() {
+        if (auto it = self->m_entries.find(origin); it != self->m_entries.end()) {
+            it->second.results = {};
+        }
+    });
+}
+
+void ResolverCache::do_resolve(std::string const& host, std::string const& port, Handler handler) {
+    auto now = std::chrono::steady_clock::now();
+    auto origin = get_origin(host, port);
+    auto& entry = m_entries[origin];
+    if (!entry.results.empty() && now < entry.expires) {
+        if (!entry.resolving && now >= entry.expires - m_options.refresh_ahead) {
+            start(origin, host, port);
+        }
+        handler({}, entry.results);
+        return;
+    }
+    entry.waiting.push_back(std::move(handler));
+    if (!entry.resolving) {
+        start(origin, host, port);
+    }
+}
+
+void ResolverCache::start(std::string const& origin,
+                          std::string const& host,
+                          std::string const& port) {
+    m_entries[origin].resolving = true;
+    m_resolver.async_resolve(
+        host, port,
+        beast::bind_front_handler(&ResolverCache::on_resolve, shared_from_this(), origin));
+}
+
+void ResolverCache::on_resolve(std::string const& origin, beast::error_code ec, Results results) {
+    auto& entry = m_entries[origin];
+    entry.resolving = false;
+    if (!ec) {
+        entry.results = results;
+        entry.expires = std::chrono::steady_clock::now() + m_options.ttl;
+    }
+    // a failed refresh keeps the previous addresses until they expire
+    auto waiting = std::move(entry.waiting);
+    if (entry.results.empty()) {
+        m_entries.erase(origin);
+    }
+    for (auto& handler : waiting) {
+        handler(ec, results);
+    }
+}
+
+SessionBase::SessionBase(std::shared_ptr<ConnectionPool> pool,
+                         std::shared_ptr<ResolverCache> resolver)
+    : m_pool{std::move(pool)}, m_resolver{std::move(resolver)} {}
+
+SessionBase::~SessionBase() {
+    // the request failed, give back the slot of its connection
+    if (m_connection) {
+        m_pool->release(std::move(m_connection), false);
+    }
+}
 
 void SessionBase::initiate_request(beast::http::verb method,
                                    std::string const& host,
+                                   std::string const& port,
                                    std::string const& target) {
     m_request.version(11);  // HTTP 1.1
     m_request.method(method);
     m_request.target(target);
-    m_request.set(beast::http::field::host, host);
+    // IPv6 addresses are enclosed in brackets
+    auto authority = host.find(':') == std::string::npos ? host : '[' + host + ']';
+    if (port != "443") {
+        authority += ':';
+        authority += port;
+    }
+    m_request.set(beast::http::field::host, authority);
     m_request.set(beast::http::field::user_agent, "async rust ffi demo");
-    m_resolver.async_resolve(
-        host, "443", beast::bind_front_handler(&SessionBase::on_resolve, shared_from_this()));
+    m_request.keep_alive(true);
+    m_ticket = m_pool->acquire(
+        host, port, beast::bind_front_handler(&SessionBase::on_connection, shared_from_this()));
+}
+
+void SessionBase::cancel() {
+    asio::post(m_pool->get_executor(), [self = shared_from_this()]() { self->do_cancel(); });
+}
+
+void SessionBase::do_cancel() {
+    if (m_cancelled) {
+        return;
+    }
+    m_cancelled = true;
+    if (m_connection) {
+        // completes the pending operation with an error, its handler closes the connection
+        beast::get_lowest_layer(m_connection->stream).cancel();
+    } else {
+        // still waiting for a connection
+        m_pool->cancel(m_ticket);
+    }
+}
+
+bool SessionBase::abort_if_cancelled() {
+    if (!m_cancelled) {
+        return false;
+    }
+    // the connection may be in the middle of a request, so it cannot be used again
+    m_pool->release(std::move(m_connection), false);
+    return true;
+}
+
+void SessionBase::on_connection(std::unique_ptr<Connection> connection) {
+    if (m_cancelled) {
+        // not used yet, so a connected one can serve the next request
+        auto reusable = connection->connected;
+        m_pool->release(std::move(connection), reusable);
+        return;
+    }
+    m_connection = std::move(connection);
+    if (m_connection->connected) {
+        write();
+        return;
+    }
+    m_resolver->resolve(m_connection->host, m_connection->port,
+                        beast::bind_front_handler(&SessionBase::on_resolve, shared_from_this()));
 }
 
 void SessionBase::on_resolve(beast::error_code ec, asio::ip::tcp::resolver::results_type results) {
+    if (abort_if_cancelled()) {
+        return;
+    }
     if (ec) {
-        std::cerr << "failed to resolve: " << ec.message() << std::endl;
+        fail(ec, "failed to resolve");
         return;
     }
-    beast::get_lowest_layer(m_stream).expires_after(std::chrono::seconds{30});
-    beast::get_lowest_layer(m_stream).async_connect(
-        results, beast::bind_front_handler(&SessionBase::on_connect, shared_from_this()));
+    beast::get_lowest_layer(m_connection->stream).expires_after(std::chrono::seconds{30});
+    beast::get_lowest_layer(m_connection->stream)
+        .async_connect(results,
+                       beast::bind_front_handler(&SessionBase::on_connect, shared_from_this()));
 }
 
 void SessionBase::on_connect(boost::beast::error_code ec,
                              boost::asio::ip::tcp::resolver::results_type::endpoint_type) {
+    if (abort_if_cancelled()) {
+        return;
+    }
+    if (ec) {
+        m_resolver->invalidate(m_connection->host, m_connection->port);
+        fail(ec, "failed to connect");
+        return;
+    }
+    ec = prepare_handshake(*m_connection);
     if (ec) {
-        std::cerr << "failed to connect: " << ec.message() << std::endl;
+        fail(ec, "failed to set up handshake");
         return;
     }
-    m_stream.async_handshake(
+    m_connection->stream.async_handshake(
         ssl::stream_base::client,
         beast::bind_front_handler(&SessionBase::on_handshake, shared_from_this()));
 }
 
 void SessionBase::on_handshake(boost::beast::error_code ec) {
+    if (abort_if_cancelled()) {
+        return;
+    }
     if (ec) {
-        std::cerr << "handshake failed: " << ec.message() << std::endl;
+        fail(ec, "handshake failed");
         return;
     }
-    beast::get_lowest_layer(m_stream).expires_after(std::chrono::seconds{30});
-    beast::http::async_write(m_stream, m_request,
+    m_connection->connected = true;
+    write();
+}
+
+void SessionBase::write() {
+    m_response = {};
+    beast::get_lowest_layer(m_connection->stream).expires_after(std::chrono::seconds{30});
+    beast::http::async_write(m_connection->stream, m_request,
                              beast::bind_front_handler(&SessionBase::on_write, shared_from_this()));
 }
 
 void SessionBase::on_write(boost::beast::error_code ec, std::size_t bytes_transferred) {
+    if (abort_if_cancelled()) {
+        return;
+    }
     if (ec) {
-        std::cerr << "write failed: " << ec.message() << std::endl;
+        fail(ec, "write failed");
         return;
     }
-    beast::http::async_read(m_stream, m_buffer, m_response,
+    beast::http::async_read(m_connection->stream, m_connection->buffer, m_response,
                             beast::bind_front_handler(&SessionBase::on_read, shared_from_this()));
 }
 
 void SessionBase::on_read(boost::beast::error_code ec, std::size_t) {
+    // a response which arrived before the request was cancelled is still handed out
+    if (ec && abort_if_cancelled()) {
+        return;
+    }
     if (ec) {
-        std::cerr << "read failed: " << ec.message() << std::endl;
+        fail(ec, "read failed");
+        return;
+    }
+    on_result(std::move(m_response.body()));
+    if (m_response.keep_alive()) {
+        m_connection->reused = true;
+        m_pool->release(std::move(m_connection), true);
         return;
     }
-    std::stringstream string_stream{};
-    string_stream << m_response.body();
-    on_result(string_stream.str());
-    beast::get_lowest_layer(m_stream).expires_after(std::chrono::seconds{30});
-    m_stream.async_shutdown(
+    beast::get_lowest_layer(m_connection->stream).expires_after(std::chrono::seconds{30});
+    m_connection->stream.async_shutdown(
         beast::bind_front_handler(&SessionBase::on_shutdown, shared_from_this()));
 }
 
 void SessionBase::on_shutdown(boost::beast::error_code ec) {
+    m_pool->release(std::move(m_connection), false);
     if (ec == boost::asio::error::eof) {
         ec = {};
     }
@@ -109,5 +462,87 @@ void SessionBase::on_shutdown(boost::beast::error_code ec) {
     }
 }
 
+void SessionBase::fail(beast::error_code ec, std::string_view what) {
+    auto reused = m_connection->reused;
+    auto host = m_connection->host;
+    auto port = m_connection->port;
+    m_pool->release(std::move(m_connection), false);
+    if (reused && !m_retried) {
+        // the server may have closed the connection while it was idle, retry once on a new one
+        m_retried = true;
+        m_ticket = m_pool->acquire(
+            std::move(host), std::move(port),
+            beast::bind_front_handler(&SessionBase::on_connection, shared_from_this()), true);
+        return;
+    }
+    on_error(RequestError{ec, what});
+}
+
 }  // namespace detail
+
+std::string RequestError::message() const {
+    std::string message{what};
+    message += ": ";
+    message += code.message();
+    return message;
+}
+
+std::optional<Url> parse_url(std::string_view url) {
+    auto scheme_end = url.find("://");
+    if (scheme_end == std::string_view::npos) {
+        return std::nullopt;
+    }
+    Url result{.scheme = url.substr(0, scheme_end)};
+    if (result.scheme == "https") {
+        result.port = "443";
+    } else if (result.scheme == "http") {
+        result.port = "80";
+    } else {
+        return std::nullopt;
+    }
+
+    auto rest = url.substr(scheme_end + 3);
+    auto authority = rest.substr(0, rest.find_first_of("/?#"));
+    rest.remove_prefix(authority.size());
+    // credentials are not supported
+    if (authority.find('@') != std::string_view::npos) {
+        return std::nullopt;
+    }
+    auto port_start = authority.rfind(':');
+    if (authority.starts_with('[')) {
+        // IPv6 address
+        auto address_end = authority.find(']');
+        if (address_end == std::string_view::npos) {
+            return std::nullopt;
+        }
+        result.host = authority.substr(1, address_end - 1);
+        if (port_start < address_end) {
+            port_start = std::string_view::npos;
+        }
+        if (address_end + 1 != std::min(port_start, authority.size())) {
+            return std::nullopt;
+        }
+    } else {
+        result.host = authority.substr(0, port_start);
+    }
+    if (port_start != std::string_view::npos) {
+        result.port = authority.substr(port_start + 1);
+        std::uint16_t port{};
+        auto [end, ec] =
+            std::from_chars(result.port.data(), result.port.data() + result.port.size(), port);
+        if (ec != std::errc{} || end != result.port.data() + result.port.size() || port == 0) {
+            return std::nullopt;
+        }
+    }
+    if (result.host.empty()) {
+        return std::nullopt;
+    }
+
+    result.target = rest.substr(0, rest.find('#'));
+    if (result.target.empty()) {
+        result.target = "/";
+    }
+    return result;
+}
+
 }  // namespace http
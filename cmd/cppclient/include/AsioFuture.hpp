@@ -0,0 +1,217 @@
+#pragma once
+// Adapter from Boost.Asio style asynchronous operations, which report their result to a
+// completion handler, to futures which are polled by Rust.
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "Pool.hpp"
+#include "Runtime.hpp"
+#include "Trace.hpp"
+#include "ffi/future.h"
+
+namespace asyncrt {
+namespace detail {
+
+/**
+ * State of an asynchronous operation which is polled as a future. The future and the completion
+ * handler hold a reference each.
+ *
+ * The waker of the latest poll is stored in the state and woken by the completion handler, so no
+ * lock is taken between the two: the handler publishes the result before taking the waker, and
+ * a poll stores its waker before checking for a result again.
+ */
+template <typename T, typename R, typename Convert>
+class AsioOperation : public PoolAllocated {
+public:
+    explicit AsioOperation(Convert convert) : m_convert{std::move(convert)} {}
+    AsioOperation(AsioOperation const&) = delete;
+    AsioOperation& operator=(AsioOperation const&) = delete;
+
+    static ::FfiPoll<T> poll(void* self, ::FfiContext* context) {
+        return static_cast<AsioOperation*>(self)->poll_impl(context);
+    }
+
+    // If the future is dropped before the operation completed, the operation is cancelled if it
+    // can be, otherwise it keeps running and its result is dropped.
+    static void drop(void* self) {
+        auto* op = static_cast<AsioOperation*>(self);
+        if (op->m_cancel && op->m_state.load() == 0) {
+            try {
+                op->m_cancel();
+            } catch (...) {
+                ASYNCRT_TRACE(Future, Warning, "failed to cancel asio operation ", self);
+            }
+        }
+        if (auto const* waker = op->m_waker.exchange(nullptr)) {
+            waker->vtable->drop(waker);
+        }
+        op->release();
+    }
+
+    // only called before the future is handed out
+    void set_cancel(std::function<void()> cancel) noexcept { m_cancel = std::move(cancel); }
+
+    template <typename... Args>
+    void complete(Args&&... args) {
+        try {
+            m_result.emplace(std::forward<Args>(args)...);
+            finish(kCompleted);
+        } catch (...) {
+            finish(kFailed);
+        }
+    }
+
+    // the operation reported an error instead of a result
+    void fail(ErrorCode code, std::string_view message) noexcept {
+        try {
+            m_error.emplace(code, std::string{message});
+        } catch (...) {
+            // fails without the reason
+        }
+        finish(kFailed);
+    }
+
+    // the completion handler was destroyed without being invoked
+    void abandon() noexcept { finish(kFailed); }
+
+private:
+    static constexpr std::uint8_t kCompleted = 1;
+    static constexpr std::uint8_t kFailed = 2;
+
+    ~AsioOperation() = default;
+
+    ::FfiPoll<T> poll_impl(::FfiContext* context) {
+        auto state = m_state.load();
+        if (state == 0) {
+            auto const* waker = context->waker->vtable->clone(context->waker);
+            if (auto const* previous = m_waker.exchange(waker)) {
+                previous->vtable->drop(previous);
+            }
+            state = m_state.load();
+            if (state == 0) {
+                return make_poll_status<T>(PollStatus::Pending);
+            }
+            // completed in the meantime, the handler may have missed the waker
+            if (auto const* own = m_waker.exchange(nullptr)) {
+                own->vtable->drop(own);
+            }
+        }
+        if (state == kFailed) {
+            if (m_error) {
+                return make_failed_poll<T>(m_error->code(), m_error->message());
+            }
+            return make_failed_poll<T>(ErrorCode::Internal, "asynchronous operation failed");
+        }
+        try {
+            return make_poll_status<T>(m_convert(std::move(*m_result)));
+        } catch (std::exception const& err) {
+            return make_failed_poll<T>(ErrorCode::Internal, err.what());
+        } catch (...) {
+            return make_failed_poll<T>(ErrorCode::Internal, "unknown exception");
+        }
+    }
+
+    void finish(std::uint8_t state) noexcept {
+        ASYNCRT_TRACE(Future, Debug, "asio operation ", static_cast<void const*>(this),
+                      state == kCompleted ? " completed" : " failed");
+        m_state.store(state);
+        if (auto const* waker = m_waker.exchange(nullptr)) {
+            waker->vtable->wake(waker);
+        }
+        release();
+    }
+
+    void release() noexcept {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    // the loads and stores of the state and the waker are sequentially consistent, so either the
+    // handler sees the waker of a poll or the poll sees the result
+    std::atomic<std::uint8_t> m_state{0};
+    std::atomic<::FfiWakerBase const*> m_waker{nullptr};
+    std::atomic<std::uint32_t> m_refs{2};
+    std::optional<R> m_result{};
+    std::optional<Error> m_error{};
+    Convert m_convert;
+    std::function<void()> m_cancel{};
+};
+
+/**
+ * Completion handler of an AsioOperation. It can be moved but not copied, so the operation fails
+ * if the handler is destroyed without being invoked, e.g. because the operation was aborted.
+ */
+template <typename Operation>
+class AsioHandler {
+public:
+    explicit AsioHandler(Operation* op) noexcept : m_op{op} {}
+    AsioHandler(AsioHandler&& other) noexcept : m_op{std::exchange(other.m_op, nullptr)} {}
+    AsioHandler(AsioHandler const&) = delete;
+
+    ~AsioHandler() {
+        if (m_op != nullptr) {
+            m_op->abandon();
+        }
+    }
+
+    AsioHandler& operator=(AsioHandler&&) = delete;
+    AsioHandler& operator=(AsioHandler const&) = delete;
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        std::exchange(m_op, nullptr)->complete(std::forward<Args>(args)...);
+    }
+
+    // Completes the operation with an error instead of a result, e.g. one reported by the
+    // operation itself.
+    void fail(ErrorCode code, std::string_view message) noexcept {
+        std::exchange(m_op, nullptr)->fail(code, message);
+    }
+
+private:
+    Operation* m_op;
+};
+
+}  // namespace detail
+
+/**
+ * Starts an asynchronous operation and returns a future which is ready once it completed.
+ *
+ * The initiation is called with a completion handler, which constructs the result R of the
+ * operation from its arguments. When the future is polled after that, convert turns the result
+ * into the output of the future. An operation which failed with a reason calls fail() on the
+ * handler instead. If the handler is destroyed without being invoked or convert throws, the future
+ * fails with ErrorCode::Internal. Failures are errors if T is an FfiResult, otherwise the future
+ * panics.
+ *
+ * The initiation may return a function cancelling the operation, which is called if the future
+ * is dropped before the operation completed. A cancelled operation usually destroys its handler
+ * without invoking it.
+ */
+template <typename T, typename R, typename Initiation, typename Convert>
+::FfiFuture<T> make_asio_future(Initiation&& initiation, Convert&& convert) {
+    using Operation = detail::AsioOperation<T, R, std::decay_t<Convert>>;
+    using Handler = detail::AsioHandler<Operation>;
+    auto* op = new Operation{std::forward<Convert>(convert)};
+    try {
+        if constexpr (std::is_void_v<std::invoke_result_t<Initiation, Handler>>) {
+            std::forward<Initiation>(initiation)(Handler{op});
+        } else {
+            op->set_cancel(std::forward<Initiation>(initiation)(Handler{op}));
+        }
+    } catch (...) {
+        Operation::drop(op);
+        throw;
+    }
+    return ::FfiFuture<T>{op, &Operation::poll, &Operation::drop};
+}
+
+}  // namespace asyncrt
@@ -5,141 +5,266 @@
 // Error handling is not refined and uses the default exceptions with custom text. This should
 // be changed for production code.
 
-#include <functional>
-#include <memory>
-#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
 #include <optional>
 #include <stdexcept>
+#include <type_traits>
+#include <utility>
 
-#include <iostream>  // TODO: debugging only
+#include "Pool.hpp"
+#include "Trace.hpp"
 
 namespace asyncrt {
 namespace detail {
 
+/**
+ * A callback which is invoked at most once. Small callables are stored inline, larger ones on the
+ * heap.
+ */
+class InlineCallback {
+public:
+    InlineCallback() = default;
+    InlineCallback(InlineCallback const&) = delete;
+    ~InlineCallback() { reset(); }
+
+    InlineCallback& operator=(InlineCallback const&) = delete;
+
+    template <typename F>
+    void emplace(F&& f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t)) {
+            ::new (static_cast<void*>(m_storage)) Fn{std::forward<F>(f)};
+            m_invoke = [](void* storage) { (*static_cast<Fn*>(storage))(); };
+            m_destroy = [](void* storage) { static_cast<Fn*>(storage)->~Fn(); };
+        } else {
+            ::new (static_cast<void*>(m_storage)) Fn*{new Fn{std::forward<F>(f)}};
+            m_invoke = [](void* storage) { (**static_cast<Fn**>(storage))(); };
+            m_destroy = [](void* storage) { delete *static_cast<Fn**>(storage); };
+        }
+    }
+
+    // Invokes the callback and destroys it afterwards.
+    void invoke() {
+        struct Reset {
+            InlineCallback& self;
+            ~Reset() { self.reset(); }
+        } reset{*this};
+        m_invoke(m_storage);
+    }
+
+    void reset() noexcept {
+        if (m_destroy != nullptr) {
+            m_destroy(m_storage);
+            m_invoke = nullptr;
+            m_destroy = nullptr;
+        }
+    }
+
+private:
+    // enough for a lambda holding a few pointers, e.g. a shared_ptr and a reference
+    static constexpr std::size_t kInlineSize = 4 * sizeof(void*);
+
+    alignas(std::max_align_t) std::byte m_storage[kInlineSize];
+    void (*m_invoke)(void*){nullptr};
+    void (*m_destroy)(void*){nullptr};
+};
+
+/**
+ * State shared by a promise and its future, for a single producer and a single consumer.
+ *
+ * The value and the callback are written before their bit is set in the state, whoever sets the
+ * second bit invokes the callback. So neither side waits for the other, and the callback runs
+ * exactly once, either on the thread setting the value or on the thread awaiting it.
+ */
 template <typename T>
-struct SharedState {
-    std::mutex mutex{};
-    std::optional<T> value{};
-    std::optional<std::function<void()>> wait_callback{};
+class SharedState : public PoolAllocated {
+public:
+    static constexpr std::uint8_t kHasValue = 1;
+    static constexpr std::uint8_t kHasCallback = 2;
+
+    SharedState() = default;
+    SharedState(SharedState const&) = delete;
+    SharedState& operator=(SharedState const&) = delete;
+
+    void acquire() noexcept { m_refs.fetch_add(1, std::memory_order_relaxed); }
+
+    void release() noexcept {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    [[nodiscard]] bool has_value() const noexcept {
+        return (m_state.load(std::memory_order_acquire) & kHasValue) != 0;
+    }
+
+    // consumer only, after has_value() returned true
+    T& value() noexcept { return *m_value; }
+
+    template <typename... Args>
+    void set_value(Args&&... args) {
+        m_value.emplace(std::forward<Args>(args)...);
+        if ((m_state.fetch_or(kHasValue, std::memory_order_acq_rel) & kHasCallback) != 0) {
+            m_callback.invoke();
+        }
+    }
+
+    template <typename F>
+    void set_callback(F&& f) {
+        auto state = m_state.load(std::memory_order_acquire);
+        if ((state & kHasCallback) != 0) {
+            throw std::logic_error{"future is already awaited on"};
+        }
+        if ((state & kHasValue) != 0) {
+            ASYNCRT_TRACE(Future, Debug, "value already available");
+            // marked as awaited, so awaiting the future again throws as well
+            m_state.fetch_or(kHasCallback, std::memory_order_relaxed);
+            f();
+            return;
+        }
+        ASYNCRT_TRACE(Future, Debug, "setting callback function");
+        m_callback.emplace(std::forward<F>(f));
+        if ((m_state.fetch_or(kHasCallback, std::memory_order_acq_rel) & kHasValue) != 0) {
+            // the value was set in the meantime, without seeing the callback
+            m_callback.invoke();
+        }
+    }
+
+private:
+    ~SharedState() = default;
+
+    std::atomic<std::uint8_t> m_state{0};
+    // the promise and the future
+    std::atomic<std::uint32_t> m_refs{1};
+    std::optional<T> m_value{};
+    InlineCallback m_callback{};
 };
 
 }  // namespace detail
 
+template <typename T>
+class Promise;
+
 template <typename T>
 class AsyncFuture {
 public:
     AsyncFuture() = default;
-    AsyncFuture(std::shared_ptr<detail::SharedState<T>> shared_state)
-        : m_shared_state{std::move(shared_state)} {}
-    AsyncFuture(AsyncFuture&&) = default;
+    AsyncFuture(AsyncFuture&& other) noexcept
+        : m_shared_state{std::exchange(other.m_shared_state, nullptr)} {}
     AsyncFuture(AsyncFuture const&) = delete;
-    ~AsyncFuture() = default;
 
-    AsyncFuture& operator=(AsyncFuture&&) = default;
+    ~AsyncFuture() {
+        if (m_shared_state != nullptr) {
+            m_shared_state->release();
+        }
+    }
+
+    AsyncFuture& operator=(AsyncFuture&& other) noexcept {
+        std::swap(m_shared_state, other.m_shared_state);
+        return *this;
+    }
+
     AsyncFuture& operator=(AsyncFuture const&) = delete;
 
-    bool valid() const noexcept { return m_shared_state; }
+    bool valid() const noexcept { return m_shared_state != nullptr; }
 
     [[nodiscard]] bool is_ready() const noexcept {
-        std::cout << "+++ [C] AsyncFuture::is_ready " << std::flush;
-        std::lock_guard lock{m_shared_state->mutex};
-        std::cout << m_shared_state->value.has_value() << std::endl;
-        return m_shared_state->value.has_value();
+        auto ready = m_shared_state->has_value();
+        ASYNCRT_TRACE(Future, Debug, "AsyncFuture::is_ready ", ready);
+        return ready;
     }
 
     [[nodiscard]] T& value() {
-        if (!m_shared_state->value) {
+        if (!m_shared_state->has_value()) {
             throw std::logic_error{"future not ready"};
         }
-        return *m_shared_state->value;
+        return m_shared_state->value();
     }
 
     [[nodiscard]] T const& value() const {
-        if (!m_shared_state->value) {
+        if (!m_shared_state->has_value()) {
             throw std::logic_error{"future not ready"};
         }
-        return *m_shared_state->value;
+        return m_shared_state->value();
     }
 
+    // The callback is invoked right away if the value is set already, otherwise by set_value().
+    // A future can only be awaited once.
     template <typename F>
     void await(F&& f) {
-        std::cout << "+++ [C] awaiting future\n";
-        std::lock_guard lock{m_shared_state->mutex};
-        if (m_shared_state->value.has_value()) {
-            std::cout << "+++ [C] value already available" << std::endl;
-            f();
-        } else {
-            std::cout << "+++ [C] setting callback function" << std::endl;
-            if (m_shared_state->wait_callback.has_value()) {
-                throw std::logic_error{"future is already awaited on"};
-            }
-            m_shared_state->wait_callback = std::function<void()>(f);
-        }
+        ASYNCRT_TRACE(Future, Debug, "awaiting future");
+        m_shared_state->set_callback(std::forward<F>(f));
     }
 
 private:
-    std::shared_ptr<detail::SharedState<T>> m_shared_state;
+    friend class Promise<T>;
+
+    explicit AsyncFuture(detail::SharedState<T>* shared_state) : m_shared_state{shared_state} {
+        m_shared_state->acquire();
+    }
+
+    detail::SharedState<T>* m_shared_state{nullptr};
 };
 
 template <typename T>
 class Promise {
 public:
-    Promise() : m_shared_state{std::make_shared<detail::SharedState<T>>()} {}
-    Promise(Promise&&) = default;
+    Promise() : m_shared_state{new detail::SharedState<T>{}} {}
+    Promise(Promise&& other) noexcept
+        : m_shared_state{std::exchange(other.m_shared_state, nullptr)},
+          m_future_created{other.m_future_created},
+          m_satisfied{other.m_satisfied} {}
     Promise(Promise const&) = delete;
-    ~Promise() = default;
 
-    Promise& operator=(Promise&&) = default;
+    ~Promise() {
+        if (m_shared_state != nullptr) {
+            m_shared_state->release();
+        }
+    }
+
+    Promise& operator=(Promise&& other) noexcept {
+        std::swap(m_shared_state, other.m_shared_state);
+        std::swap(m_future_created, other.m_future_created);
+        std::swap(m_satisfied, other.m_satisfied);
+        return *this;
+    }
+
     Promise& operator=(Promise const&) = delete;
 
     AsyncFuture<T> get_future() {
         if (m_future_created) {
             throw std::logic_error{"future already retrieved"};
         }
-        if (!m_shared_state) {
+        if (m_shared_state == nullptr) {
             throw std::logic_error{"promise has no shared state"};
         }
+        m_future_created = true;
         return AsyncFuture<T>{m_shared_state};
     }
 
-    void set_value(T const& t) {
-        if (!m_shared_state) {
-            throw std::logic_error{"promise has no shared state"};
-        }
-        {
-            std::lock_guard lock{m_shared_state->mutex};
-            if (m_satisfied) {
-                throw std::logic_error{"promise already satisfied"};
-            }
-            std::cout << "+++ [C] storing value in promise" << std::endl;
-            m_shared_state->value = t;
-            m_satisfied = true;
-        }
-        if (m_shared_state->wait_callback.has_value()) {
-            (*m_shared_state->wait_callback)();
-        }
-    }
+    // The callback of the future is invoked on the calling thread if it was awaited already.
+    void set_value(T const& t) { set(t); }
 
-    void set_value(T&& t) {
-        if (!m_shared_state) {
+    void set_value(T&& t) { set(std::move(t)); }
+
+private:
+    template <typename U>
+    void set(U&& u) {
+        if (m_shared_state == nullptr) {
             throw std::logic_error{"promise has no shared state"};
         }
-        {
-            std::lock_guard lock{m_shared_state->mutex};
-            if (m_satisfied) {
-                throw std::logic_error{"promise already satisfied"};
-            }
-            std::cout << "+++ [C] storing value in promise" << std::endl;
-            m_shared_state->value.emplace(std::forward<T>(t));
-            m_satisfied = true;
-        }
-        if (m_shared_state->wait_callback.has_value()) {
-            (*m_shared_state->wait_callback)();
+        if (m_satisfied) {
+            throw std::logic_error{"promise already satisfied"};
         }
+        ASYNCRT_TRACE(Future, Debug, "storing value in promise");
+        m_satisfied = true;
+        m_shared_state->set_value(std::forward<U>(u));
     }
 
-private:
-    std::shared_ptr<detail::SharedState<T>> m_shared_state;
+    detail::SharedState<T>* m_shared_state;
     bool m_future_created{false};
     bool m_satisfied{false};
 };
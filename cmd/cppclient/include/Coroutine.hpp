@@ -0,0 +1,369 @@
+#pragma once
+// Coroutines awaiting Rust futures. A Lazy<T> coroutine can co_await RustFutures and other Lazy
+// coroutines; the outermost one is run by an executor with Executor::await(). Awaiting a future of
+// an FfiResult<T> yields std::expected<T, Error>, only panics are thrown.
+//
+// All coroutines awaited by the outermost one run within a single task, whose waker is handed to
+// the Rust futures. The coroutine frames are allocated from the pool, and nested coroutines which
+// are awaited right away are candidates for heap allocation elision.
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "Pool.hpp"
+#include "Runtime.hpp"
+#include "Trace.hpp"
+
+namespace asyncrt {
+
+// Thrown by co_await if the awaited Rust future panicked.
+class FuturePanicked : public std::runtime_error {
+public:
+    FuturePanicked() : std::runtime_error{"Rust future panicked"} {}
+};
+
+namespace detail {
+
+// A Rust future a coroutine is suspended on.
+class PendingPoll {
+public:
+    // Returns true once the future finished.
+    virtual bool poll(::FfiContext* context) = 0;
+
+protected:
+    ~PendingPoll() = default;
+};
+
+/**
+ * Task running a coroutine. Whenever the coroutine is suspended on a Rust future, the task polls
+ * that future when it is woken, and resumes the coroutine once the future finished.
+ */
+class CoroutineTaskBase : public TaskBase {
+public:
+    // Called by a coroutine suspending on the future, after the future returned pending.
+    void suspend(PendingPoll& pending, std::coroutine_handle<> handle) noexcept {
+        m_pending = &pending;
+        m_resume = handle;
+    }
+
+    // Uses up one unit of the budget of the current poll, returns false if none is left.
+    [[nodiscard]] bool consume_budget() noexcept {
+        if (m_budget == 0) {
+            return false;
+        }
+        --m_budget;
+        return true;
+    }
+
+    // Called by a coroutine instead of polling the future once the budget is used up. The task is
+    // queued again and polls the future first thing in its next poll.
+    void defer(PendingPoll& pending, std::coroutine_handle<> handle) {
+        // the task is running, so it is only queued again after this poll
+        yield_budget();
+        suspend(pending, handle);
+    }
+
+protected:
+    CoroutineTaskBase(std::coroutine_handle<> root, Executor& executor, TaskId id)
+        : TaskBase{executor, id}, m_root{root}, m_resume{root} {}
+
+    [[nodiscard]] PollStatus poll_impl(Executor&) override {
+        m_budget = poll_budget();
+        if (m_pending != nullptr) {
+            if (!m_pending->poll(get_context())) {
+                return PollStatus::Pending;
+            }
+            m_pending = nullptr;
+        }
+        std::exchange(m_resume, nullptr).resume();
+        if (m_pending != nullptr) {
+            return PollStatus::Pending;
+        }
+        if (!m_root.done()) {
+            // suspended on something which is not polled by the task, it would never be resumed
+            ASYNCRT_TRACE(Task, Error, "coroutine of task ", get_id(),
+                          " suspended without a future");
+            return PollStatus::Panicked;
+        }
+        return finish();
+    }
+
+    void drop_future() noexcept override {
+        m_pending = nullptr;
+        m_resume = nullptr;
+    }
+
+    // Called once the coroutine returned or threw.
+    virtual PollStatus finish() = 0;
+
+private:
+    PendingPoll* m_pending{nullptr};
+    std::coroutine_handle<> m_root;
+    std::coroutine_handle<> m_resume;
+    // futures the coroutine may still poll within the current poll of the task
+    std::size_t m_budget{0};
+};
+
+// What a Lazy coroutine can co_await, the task could not resume it after anything else.
+template <typename T>
+inline constexpr bool kLazyAwaitable = false;
+
+template <typename T>
+inline constexpr bool kLazyAwaitable<RustFuture<T>> = true;
+
+class LazyPromiseBase : public PoolAllocated {
+public:
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+            // continue with the awaiting coroutine, or return to the task
+            if (auto continuation = handle.promise().m_continuation) {
+                return continuation;
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+
+    void unhandled_exception() noexcept { m_exception = std::current_exception(); }
+
+    template <typename A>
+    A&& await_transform(A&& awaitable) noexcept {
+        static_assert(kLazyAwaitable<std::remove_cvref_t<A>>,
+                      "a Lazy coroutine can only co_await RustFutures and Lazy coroutines");
+        return std::forward<A>(awaitable);
+    }
+
+    CoroutineTaskBase* task() const noexcept { return m_task; }
+
+    void start(CoroutineTaskBase& task, std::coroutine_handle<> continuation) noexcept {
+        m_task = &task;
+        m_continuation = continuation;
+    }
+
+    void rethrow_if_failed() const {
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+    }
+
+private:
+    CoroutineTaskBase* m_task{nullptr};
+    std::coroutine_handle<> m_continuation{};
+    std::exception_ptr m_exception{};
+};
+
+template <typename T>
+class LazyPromise;
+
+template <typename T>
+class LazyAwaiter;
+
+}  // namespace detail
+
+/**
+ * Coroutine which only starts once it is awaited, or run by an executor.
+ */
+template <typename T = void>
+class [[nodiscard]] Lazy {
+public:
+    using promise_type = detail::LazyPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit Lazy(Handle handle) noexcept : m_handle{handle} {}
+    Lazy(Lazy&& other) noexcept : m_handle{std::exchange(other.m_handle, nullptr)} {}
+    Lazy(Lazy const&) = delete;
+
+    ~Lazy() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    Lazy& operator=(Lazy&&) = delete;
+    Lazy& operator=(Lazy const&) = delete;
+
+    Handle handle() const noexcept { return m_handle; }
+
+    detail::LazyAwaiter<T> operator co_await() && noexcept {
+        return detail::LazyAwaiter<T>{m_handle};
+    }
+
+private:
+    Handle m_handle;
+};
+
+namespace detail {
+
+template <typename T>
+inline constexpr bool kLazyAwaitable<Lazy<T>> = true;
+
+template <typename T>
+class LazyPromise : public LazyPromiseBase {
+public:
+    Lazy<T> get_return_object() noexcept {
+        return Lazy<T>{std::coroutine_handle<LazyPromise>::from_promise(*this)};
+    }
+
+    template <typename U>
+    void return_value(U&& value) {
+        m_value.emplace(std::forward<U>(value));
+    }
+
+    T result() {
+        rethrow_if_failed();
+        return std::move(*m_value);
+    }
+
+    // the value of the outermost coroutine, which is passed to the callback
+    T& value() noexcept { return *m_value; }
+
+private:
+    std::optional<T> m_value{};
+};
+
+template <>
+class LazyPromise<void> : public LazyPromiseBase {
+public:
+    Lazy<void> get_return_object() noexcept {
+        return Lazy<void>{std::coroutine_handle<LazyPromise>::from_promise(*this)};
+    }
+
+    void return_void() const noexcept {}
+
+    void result() const { rethrow_if_failed(); }
+};
+
+// Starts an awaited coroutine, the awaiting one is resumed once it finished.
+template <typename T>
+class LazyAwaiter {
+public:
+    explicit LazyAwaiter(std::coroutine_handle<LazyPromise<T>> handle) noexcept
+        : m_handle{handle} {}
+
+    bool await_ready() const noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiting) noexcept {
+        m_handle.promise().start(*awaiting.promise().task(), awaiting);
+        return m_handle;
+    }
+
+    T await_resume() { return m_handle.promise().result(); }
+
+private:
+    std::coroutine_handle<LazyPromise<T>> m_handle;
+};
+
+template <typename T>
+class RustFutureAwaiter final : public PendingPoll {
+public:
+    explicit RustFutureAwaiter(RustFuture<T>&& future) : m_future{std::move(future)} {}
+
+    bool await_ready() const noexcept { return false; }
+
+    // Polls the future right away, and only suspends the coroutine if it is pending or the
+    // budget of the task is used up.
+    template <typename P>
+    bool await_suspend(std::coroutine_handle<P> handle) {
+        auto& task = *handle.promise().task();
+        if (!task.consume_budget()) {
+            task.defer(*this, handle);
+            return true;
+        }
+        if (poll(task.get_context())) {
+            return false;
+        }
+        task.suspend(*this, handle);
+        return true;
+    }
+
+    Output<T> await_resume() {
+        if (m_status == PollStatus::Panicked) {
+            throw FuturePanicked{};
+        }
+        return std::move(*m_value);
+    }
+
+    bool poll(::FfiContext* context) override {
+        auto poll = m_future.poll(context);
+        if (poll.status == PollStatus::Pending) {
+            return false;
+        }
+        m_status = poll.status;
+        if (poll.status == PollStatus::Ready) {
+            m_value.emplace(take_output(poll.value));
+        }
+        return true;
+    }
+
+private:
+    RustFuture<T> m_future;
+    PollStatus m_status{PollStatus::Pending};
+    std::optional<Output<T>> m_value{};
+};
+
+/**
+ * Runs the outermost coroutine. The callback is invoked with its result, it is destroyed without
+ * being invoked if the coroutine threw.
+ */
+template <typename T, typename F>
+class CoroutineTask : public CoroutineTaskBase {
+public:
+    CoroutineTask(Lazy<T> coroutine, F&& callback, Executor& executor, TaskId id)
+        : CoroutineTaskBase{coroutine.handle(), executor, id},
+          m_coroutine{std::move(coroutine)},
+          m_callback{std::forward<F>(callback)} {
+        m_coroutine->handle().promise().start(*this, nullptr);
+    }
+
+protected:
+    PollStatus finish() override {
+        auto& promise = m_coroutine->handle().promise();
+        try {
+            promise.rethrow_if_failed();
+        } catch (std::exception const& err) {
+            ASYNCRT_TRACE(Task, Warning, "coroutine of task ", get_id(), " threw: ", err.what());
+            return PollStatus::Panicked;
+        } catch (...) {
+            ASYNCRT_TRACE(Task, Warning, "coroutine of task ", get_id(), " threw");
+            return PollStatus::Panicked;
+        }
+        if constexpr (std::is_void_v<T>) {
+            (*m_callback)();
+        } else {
+            (*m_callback)(std::move(promise.value()));
+        }
+        return PollStatus::Ready;
+    }
+
+    void drop_future() noexcept override {
+        CoroutineTaskBase::drop_future();
+        // destroys the frames of the awaited coroutines and the futures they are suspended on
+        m_coroutine.reset();
+        m_callback.reset();
+    }
+
+private:
+    std::optional<Lazy<T>> m_coroutine;
+    std::optional<std::decay_t<F>> m_callback;
+};
+
+}  // namespace detail
+
+template <typename T>
+detail::RustFutureAwaiter<T> operator co_await(RustFuture<T>&& future) {
+    return detail::RustFutureAwaiter<T>{std::move(future)};
+}
+
+}  // namespace asyncrt
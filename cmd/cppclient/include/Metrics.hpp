@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+#include "Pool.hpp"
+
+namespace asyncrt {
+
+/**
+ * Copy of a Histogram. Values are grouped into log-linear buckets: below 8 every value has its
+ * own bucket, above that every power of two is split into 8 buckets, so values are reported with
+ * a relative error below 12.5%.
+ */
+struct HistogramSnapshot {
+    static constexpr std::size_t kSubBuckets = 8;
+    static constexpr std::size_t kBuckets = 62 * kSubBuckets;
+
+    std::array<std::uint64_t, kBuckets> buckets{};
+    std::uint64_t count{0};
+    std::uint64_t sum{0};
+    std::uint64_t max{0};
+
+    // Returns the upper bound of the bucket containing the given quantile, 0 <= q <= 1.
+    std::uint64_t quantile(double q) const noexcept;
+    double mean() const noexcept;
+
+    HistogramSnapshot& operator+=(HistogramSnapshot const& other) noexcept;
+
+    static std::size_t bucket_index(std::uint64_t value) noexcept;
+    static std::uint64_t bucket_upper_bound(std::size_t index) noexcept;
+};
+
+/**
+ * Histogram which can be recorded into from any thread without locking.
+ */
+class Histogram {
+public:
+    void record(std::uint64_t value) noexcept;
+    void snapshot_into(HistogramSnapshot& snapshot) const noexcept;
+
+private:
+    std::array<std::atomic<std::uint64_t>, HistogramSnapshot::kBuckets> m_buckets{};
+    std::atomic<std::uint64_t> m_count{0};
+    std::atomic<std::uint64_t> m_sum{0};
+    std::atomic<std::uint64_t> m_max{0};
+};
+
+struct MetricsSnapshot {
+    std::uint64_t tasks_spawned{0};
+    std::uint64_t tasks_completed{0};
+    std::uint64_t tasks_panicked{0};
+    std::uint64_t tasks_cancelled{0};
+    // tasks whose deadline passed before their future finished
+    std::uint64_t tasks_expired{0};
+    std::uint64_t polls{0};
+    std::uint64_t wakes{0};
+    // times the executor stopped polling ready tasks to let other work run, see
+    // ExecutorOptions::max_polls_per_tick and ExecutorOptions::poll_budget
+    std::uint64_t budget_yields{0};
+    // polls of tasks which waited longer than ExecutorOptions::starvation_threshold
+    std::uint64_t starved_polls{0};
+    // deadlines and sleeps which passed while they were registered
+    std::uint64_t timers_expired{0};
+
+    // unfinished tasks
+    std::size_t tasks_active{0};
+    // finished tasks whose memory is still referenced by a waker
+    std::size_t tasks_lingering{0};
+    // tasks waiting in a run queue
+    std::size_t queue_depth{0};
+    // deadlines and sleeps registered with the timer wheel
+    std::size_t timers_pending{0};
+
+    // Polls by thread. The first entry counts polls on threads not owned by the executor, the
+    // others polls on the workers of a multi-threaded executor.
+    std::vector<std::uint64_t> polls_by_thread{};
+
+    HistogramSnapshot wake_to_poll_ns{};
+    HistogramSnapshot spawn_to_complete_ns{};
+    HistogramSnapshot polls_per_task{};
+
+    // the pool is shared by all executors of the process
+    PoolStats pool{};
+};
+
+// Writes the snapshot in the Prometheus text format.
+std::ostream& operator<<(std::ostream& os, MetricsSnapshot const& snapshot);
+
+namespace detail {
+
+inline std::int64_t now_ns() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Counters of a single thread, so threads do not contend on the same cache lines.
+struct alignas(64) MetricsShard {
+    std::atomic<std::uint64_t> tasks_spawned{0};
+    std::atomic<std::uint64_t> tasks_completed{0};
+    std::atomic<std::uint64_t> tasks_panicked{0};
+    std::atomic<std::uint64_t> tasks_cancelled{0};
+    std::atomic<std::uint64_t> tasks_expired{0};
+    std::atomic<std::uint64_t> polls{0};
+    std::atomic<std::uint64_t> wakes{0};
+    std::atomic<std::uint64_t> budget_yields{0};
+    std::atomic<std::uint64_t> starved_polls{0};
+
+    Histogram wake_to_poll_ns{};
+    Histogram spawn_to_complete_ns{};
+    Histogram polls_per_task{};
+};
+
+class Metrics {
+public:
+    explicit Metrics(std::size_t shards);
+
+    MetricsShard& shard(std::size_t index) noexcept { return *m_shards[index]; }
+
+    // fills in the counters and histograms, but not the gauges
+    MetricsSnapshot snapshot() const;
+
+private:
+    std::vector<std::unique_ptr<MetricsShard>> m_shards{};
+};
+
+}  // namespace detail
+}  // namespace asyncrt
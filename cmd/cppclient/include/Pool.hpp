@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace asyncrt {
+
+// Counters of the pool allocator, summed over all threads.
+struct PoolStats {
+    // blocks handed out and returned
+    std::uint64_t allocations{0};
+    std::uint64_t deallocations{0};
+    // allocations too large for the pool, served by the general-purpose allocator
+    std::uint64_t oversized{0};
+    // memory the pool took from the general-purpose allocator, it is never given back
+    std::uint64_t chunks{0};
+    std::uint64_t reserved_bytes{0};
+};
+
+PoolStats pool_stats();
+
+namespace detail {
+
+/**
+ * Size-class allocator for the bookkeeping objects of the runtime, e.g. tasks and the futures
+ * handed to Rust.
+ *
+ * Every thread keeps a free list per size class, so allocating and freeing a block is a pointer
+ * swap without locking. Blocks may be freed on any thread. Threads with too many free blocks hand
+ * a batch of them to a shared list, threads without free blocks take a batch from there, and only
+ * if it is empty a new chunk is allocated. Sizes above the largest class use operator new.
+ */
+void* pool_allocate(std::size_t size);
+void pool_deallocate(void* ptr, std::size_t size) noexcept;
+
+/**
+ * Base class making new and delete of the derived classes use the pool. For classes with a
+ * virtual destructor, delete through a base pointer passes the size of the dynamic type.
+ */
+class PoolAllocated {
+public:
+    static void* operator new(std::size_t size) { return pool_allocate(size); }
+
+    static void operator delete(void* ptr, std::size_t size) noexcept {
+        pool_deallocate(ptr, size);
+    }
+
+    // over-aligned types are rare, they bypass the pool
+    static void* operator new(std::size_t size, std::align_val_t alignment) {
+        return ::operator new(size, alignment);
+    }
+
+    static void operator delete(void* ptr, std::size_t size, std::align_val_t alignment) noexcept {
+        ::operator delete(ptr, size, alignment);
+    }
+};
+
+}  // namespace detail
+}  // namespace asyncrt
@@ -0,0 +1,109 @@
+#pragma once
+// Errors which futures return as ordinary results instead of panicking. A future whose output is
+// an FfiResult<T> hands std::expected<T, Error> to the callbacks of the executor and to co_await.
+
+#include <expected>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "ffi/future.h"
+#include "ffi/result.h"
+
+namespace asyncrt {
+
+using ErrorCode = ::FfiErrorCode;
+
+/**
+ * Error code and message of a failed future, the message is copied out of the FfiError.
+ */
+class Error {
+public:
+    Error(ErrorCode code, std::string message) : m_code{code}, m_message{std::move(message)} {}
+
+    // Takes over an error received through the FFI and frees its message.
+    static Error from_ffi(::FfiError error) noexcept;
+
+    ErrorCode code() const noexcept { return m_code; }
+    std::string const& message() const noexcept { return m_message; }
+
+    // Copies the error, e.g. to hand it to Rust, which frees the message.
+    ::FfiError to_ffi() const;
+
+private:
+    ErrorCode m_code;
+    std::string m_message;
+};
+
+// Never throws, a message which cannot be allocated is left out.
+::FfiError make_ffi_error(ErrorCode code, std::string_view message) noexcept;
+
+template <typename T>
+::FfiResult<T> make_ffi_ok(T value) {
+    return ::FfiResult<T>{.tag = ::FfiResultTag::Ok, .ok = std::move(value)};
+}
+
+template <typename T>
+::FfiResult<T> make_ffi_err(::FfiError error) {
+    return ::FfiResult<T>{.tag = ::FfiResultTag::Err, .err = error};
+}
+
+/**
+ * Converts the output of a future into what the callbacks of the executor receive and co_await
+ * yields. Specialize it for FFI types which own a resource, so the receiver takes over an owning
+ * type instead of having to free the resource itself.
+ */
+template <typename T>
+struct OutputTraits {
+    using Output = T;
+
+    static Output take(T& value) { return std::move(value); }
+};
+
+template <typename T>
+struct OutputTraits<::FfiResult<T>> {
+    using Output = std::expected<T, Error>;
+
+    static Output take(::FfiResult<T>& value) {
+        if (value.tag == ::FfiResultTag::Ok) {
+            return std::move(value.ok);
+        }
+        return std::unexpected{Error::from_ffi(value.err)};
+    }
+};
+
+// What the callbacks receive for a future with the output T.
+template <typename T>
+using Output = typename OutputTraits<T>::Output;
+
+// Takes over the result of a future, e.g. FfiResult<T> is converted to std::expected<T, Error>.
+template <typename T>
+Output<T> take_output(T& value) {
+    return OutputTraits<T>::take(value);
+}
+
+namespace detail {
+
+template <typename T>
+inline constexpr bool kIsResult = false;
+
+template <typename T>
+inline constexpr bool kIsResult<::FfiResult<T>> = true;
+
+}  // namespace detail
+
+// The poll of a future which failed: ready with an error if its output is an FfiResult, otherwise
+// it can only panic.
+template <typename T>
+::FfiPoll<T> make_failed_poll(ErrorCode code, std::string_view message) noexcept {
+    if constexpr (detail::kIsResult<T>) {
+        return ::FfiPoll<T>{.status = PollStatus::Ready, .value = {
+            .tag = ::FfiResultTag::Err,
+            .err = make_ffi_error(code, message),
+        }};
+    } else {
+        return ::FfiPoll<T>{.status = PollStatus::Panicked};
+    }
+}
+
+}  // namespace asyncrt
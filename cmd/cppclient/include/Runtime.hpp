@@ -1,24 +1,41 @@
 #pragma once
 
 #include "Drop.hpp"
+#include "Metrics.hpp"
+#include "Pool.hpp"
+#include "Result.hpp"
+#include "TaskTable.hpp"
+#include "TimerWheel.hpp"
+#include "Trace.hpp"
+#include "WorkerPool.hpp"
 #include "ffi/future.h"
+#include "ffi/layout.h"
+#include "ffi/stream.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
-#include <vector>
+#include <type_traits>
+#include <utility>
 
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
 
-#include <iostream>
-
 namespace asyncrt {
 
 using PollStatus = ::PollStatus;
+using StreamPollStatus = ::StreamPollStatus;
 
 // A future which is passed from Rust to C++
 template <typename T>
 class RustFuture {
+    static_assert(ffi_layout::poll_matches<T>(), "FfiPoll<T> does not match async_ffi::FfiPoll<T>");
+
 public:
     RustFuture(::FfiFuture<T> f) : m_ffi_future{std::move(f)} {}
     RustFuture(RustFuture const&) = delete;
@@ -36,8 +53,13 @@ public:
     RustFuture& operator=(RustFuture const&) = delete;
 
     RustFuture& operator=(RustFuture&& other) {
-        m_ffi_future.fut_ptr = other.m_ffi_future.fut_ptr;
-        other.m_ffi_future.fut_ptr = nullptr;
+        if (this != &other) {
+            if (m_ffi_future.fut_ptr != nullptr) {
+                m_ffi_future.drop_fn(m_ffi_future.fut_ptr);
+            }
+            m_ffi_future = std::exchange(other.m_ffi_future, {});
+        }
+        return *this;
     }
 
     ::FfiPoll<T> poll(::FfiContext* context) {
@@ -48,17 +70,79 @@ private:
     ::FfiFuture<T> m_ffi_future;
 };
 
+// A stream which is passed from Rust to C++
+template <typename T>
+class RustStream {
+    static_assert(ffi_layout::stream_poll_matches<T>(), "FfiStreamPoll<T> does not match Rust");
+
+public:
+    RustStream(::FfiStream<T> s) : m_ffi_stream{s} {}
+    RustStream(RustStream const&) = delete;
+
+    RustStream(RustStream&& other) noexcept : m_ffi_stream{other.m_ffi_stream} {
+        other.m_ffi_stream.stream_ptr = nullptr;
+    }
+
+    ~RustStream() {
+        if (m_ffi_stream.stream_ptr != nullptr) {
+            m_ffi_stream.drop_fn(m_ffi_stream.stream_ptr);
+        }
+    }
+
+    RustStream& operator=(RustStream const&) = delete;
+    RustStream& operator=(RustStream&&) = delete;
+
+    ::FfiStreamPoll<T> poll_next(::FfiContext* context) {
+        return m_ffi_stream.poll_next_fn(m_ffi_stream.stream_ptr, context);
+    }
+
+private:
+    ::FfiStream<T> m_ffi_stream;
+};
+
 class Executor;
 
+template <typename T>
+class Lazy;
+
+/**
+ * Refers to a task of an executor. Cancelling the task drops its future before it is polled
+ * again, and its callback is destroyed without being invoked. A handle must not be used after its
+ * executor was destroyed.
+ */
+class TaskHandle {
+public:
+    TaskHandle() noexcept = default;
+    TaskHandle(Executor& executor, TaskId id) noexcept : m_executor{&executor}, m_id{id} {}
+
+    TaskId id() const noexcept { return m_id; }
+
+    // Can be called from any thread. Has no effect on an empty handle or a finished task, and a
+    // poll running at the moment may still finish the task.
+    void cancel() const;
+
+private:
+    Executor* m_executor{nullptr};
+    TaskId m_id{};
+};
+
 namespace detail {
 
 class TaskBase;
 
+template <typename T, typename F>
+class CoroutineTask;
+
+/**
+ * The waker handed to Rust, embedded in its task. Cloning and dropping only change the reference
+ * count of the task, so they never allocate, and a clone keeps the task alive.
+ */
 class Waker : public ::FfiWakerBase {
 public:
-    Waker(Executor& executor, TaskBase& task);
-    ~Waker();
+    explicit Waker(TaskBase& task);
 
+    Waker(Waker const&) = delete;
+    Waker(Waker&&) = delete;
     Waker& operator=(Waker const&) = delete;
     Waker& operator=(Waker&&) = delete;
 
@@ -75,36 +159,121 @@ public:
     static void drop(::FfiWakerBase const* self) { static_cast<Waker const*>(self)->drop_impl(); }
 
 private:
-    Waker(Waker const&) = default;
-    Waker(Waker&&) = default;
-
     ::FfiWakerBase const* clone_impl() const;
     void wake_impl() const;
     void wake_by_ref_impl() const;
     void drop_impl() const;
 
-    Executor& m_Executor;
     TaskBase& m_task;
 };
 
-class TaskBase {
+/**
+ * Header of every task. The executor holds one reference until the task finished, every waker
+ * clone holds another one; the task is freed once all references are released.
+ */
+class TaskBase : public PoolAllocated {
 protected:
-    TaskBase(Executor& executor, uint64_t id);
+    TaskBase(Executor& executor, TaskId id);
     virtual ~TaskBase();
 
     virtual PollStatus poll_impl(Executor& executor) = 0;
 
+    // Destroys the future and the callback of a finished task. Wakers may still reference the
+    // task afterwards, but waking it has no effect anymore.
+    virtual void drop_future() noexcept = 0;
+
+    // ExecutorOptions::poll_budget of the executor.
+    std::size_t poll_budget() const noexcept;
+    // Queues the task again because it used up its budget for this poll.
+    void yield_budget();
+    // Marks a task which finishes with this poll as expired, so it is not counted as completed.
+    void expire() noexcept { m_expired = true; }
+
 public:
-    [[nodiscard]] bool poll(Executor& executor);
+    TaskBase(TaskBase const&) = delete;
+    TaskBase& operator=(TaskBase const&) = delete;
 
-    uint64_t get_id() const noexcept { return m_id; }
+    [[nodiscard]] PollStatus poll(Executor& executor);
+
+    TaskId get_id() const noexcept { return m_id; }
 
     ::FfiContext* get_context() noexcept { return &m_context; }
 
+    // Queues the task on its executor, unless it is queued already or finished.
+    void wake();
+
+    void acquire() noexcept { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void release() noexcept;
+
+    // Marks the task as cancelled and wakes it, so the executor drops it.
+    void cancel();
+
 private:
-    uint64_t m_id;
-    DropPtr<Waker> m_waker;
+    friend class TaskTable;
+    friend class ReadyQueue;
+    friend class asyncrt::Executor;
+
+    // Scheduling state, so that a task is queued at most once and never polled concurrently.
+    // Wake-ups while the task is queued are coalesced, wake-ups while it is being polled make the
+    // executor queue it again after the poll.
+    static constexpr std::uint8_t kScheduled = 1;
+    static constexpr std::uint8_t kRunning = 2;
+    static constexpr std::uint8_t kNotified = 4;
+    static constexpr std::uint8_t kCompleted = 8;
+
+    // Like acquire(), but fails if the last reference was released already.
+    [[nodiscard]] bool try_acquire() noexcept;
+    // Returns true if the caller has to queue the task.
+    [[nodiscard]] bool schedule() noexcept;
+    void begin_poll() noexcept;
+    // Returns true if the task was woken during the poll and has to be queued again.
+    [[nodiscard]] bool end_poll() noexcept;
+    void complete() noexcept;
+
+    Executor& m_executor;
+    TaskId m_id;
+    Waker m_waker;
     ::FfiContext m_context;
+
+    std::atomic<std::uint8_t> m_state{0};
+    std::atomic<std::uint32_t> m_refs{1};
+    std::atomic<bool> m_cancelled{false};
+    TaskBase* m_next_ready{nullptr};
+
+    // for the metrics, only accessed by the thread polling the task, or before it is queued
+    std::int64_t m_spawned_ns;
+    std::int64_t m_scheduled_ns;
+    std::uint32_t m_polls{0};
+    bool m_expired{false};
+};
+
+/**
+ * Intrusive queue of tasks ready to be polled. Any thread may push, only a single consumer pops.
+ * Pushing is a single atomic exchange, the consumer takes all pushed tasks at once.
+ */
+class ReadyQueue {
+public:
+    ReadyQueue() = default;
+    ReadyQueue(ReadyQueue const&) = delete;
+    ReadyQueue& operator=(ReadyQueue const&) = delete;
+
+    void push(TaskBase& task) noexcept;
+
+    // consumer only
+    [[nodiscard]] TaskBase* pop() noexcept;
+
+    // Moves all pushed tasks to the consumer side, returns false if there were none.
+    bool collect() noexcept;
+
+    // consumer only, true if no collected task is left
+    [[nodiscard]] bool empty() const noexcept { return m_head == nullptr; }
+
+private:
+    // pushed tasks, in reverse order
+    std::atomic<TaskBase*> m_incoming{nullptr};
+    // collected tasks, in order, only accessed by the consumer
+    TaskBase* m_head{nullptr};
+    TaskBase* m_tail{nullptr};
 };
 
 /**
@@ -113,46 +282,259 @@ private:
 template <typename T, typename F>
 class Task : public detail::TaskBase {
 public:
-    Task(RustFuture<T> future, F&& callback, Executor& executor, uint64_t id)
-        : TaskBase{executor, id}, m_future{std::move(future)}, m_callback{std::move(callback)} {}
+    Task(RustFuture<T> future, F&& callback, Executor& executor, TaskId id)
+        : TaskBase{executor, id},
+          m_future{std::move(future)},
+          m_callback{std::forward<F>(callback)} {}
 
 protected:
     [[nodiscard]] PollStatus poll_impl(Executor& executor) override {
-        auto poll = m_future.poll(get_context());
+        auto poll = m_future->poll(get_context());
         if (poll.status == PollStatus::Ready) {
-            m_callback(poll.value);
+            auto output = take_output(poll.value);
+            (*m_callback)(std::move(output));
         }
         return poll.status;
     }
 
+    void drop_future() noexcept override {
+        m_future.reset();
+        m_callback.reset();
+    }
+
+private:
+    std::optional<RustFuture<T>> m_future;
+    std::optional<std::decay_t<F>> m_callback;
+};
+
+/**
+ * Stores a stream and the callback for its items. The task stays alive until the stream ended or
+ * the callback asked to stop, so all items are polled with the same task and waker.
+ */
+template <typename T, typename F>
+class StreamTask : public detail::TaskBase {
+public:
+    StreamTask(RustStream<T> stream, F&& callback, Executor& executor, TaskId id)
+        : TaskBase{executor, id},
+          m_stream{std::move(stream)},
+          m_callback{std::forward<F>(callback)} {}
+
+protected:
+    [[nodiscard]] PollStatus poll_impl(Executor& executor) override {
+        auto poll = m_stream->poll_next(get_context());
+        switch (poll.status) {
+        case StreamPollStatus::Ready:
+            if (!(*m_callback)(poll.value)) {
+                return PollStatus::Ready;
+            }
+            // Queue the task again instead of polling the next item right away, so a stream
+            // which is always ready does not starve the other tasks.
+            wake();
+            return PollStatus::Pending;
+        case StreamPollStatus::Pending:
+            return PollStatus::Pending;
+        case StreamPollStatus::Panicked:
+            return PollStatus::Panicked;
+        case StreamPollStatus::Done:
+            break;
+        }
+        return PollStatus::Ready;
+    }
+
+    void drop_future() noexcept override {
+        m_stream.reset();
+        m_callback.reset();
+    }
+
 private:
-    RustFuture<T> m_future;
-    F m_callback;
+    std::optional<RustStream<T>> m_stream;
+    std::optional<std::decay_t<F>> m_callback;
+};
+
+/**
+ * Task whose future is dropped if it did not finish before its deadline, on_expired is invoked
+ * instead of the callback then.
+ */
+template <typename T, typename F, typename E>
+class DeadlineTask : public detail::TaskBase {
+public:
+    DeadlineTask(RustFuture<T> future,
+                 TimerWheel& timers,
+                 std::chrono::steady_clock::time_point deadline,
+                 F&& callback,
+                 E&& on_expired,
+                 Executor& executor,
+                 TaskId id)
+        : TaskBase{executor, id},
+          m_future{std::move(future)},
+          m_callback{std::forward<F>(callback)},
+          m_on_expired{std::forward<E>(on_expired)},
+          m_timers{timers},
+          m_deadline{deadline} {}
+
+protected:
+    [[nodiscard]] PollStatus poll_impl(Executor&) override {
+        // the waker of the task never changes, so the deadline is registered on the first poll
+        auto expired = m_registered ? m_deadline.expired()
+                                    : m_timers.poll(m_deadline, get_context());
+        m_registered = true;
+        if (expired) {
+            ASYNCRT_TRACE(Task, Info, "task ", get_id(), " missed its deadline");
+            m_future.reset();
+            expire();
+            (*m_on_expired)();
+            return PollStatus::Ready;
+        }
+        auto poll = m_future->poll(get_context());
+        if (poll.status == PollStatus::Ready) {
+            auto output = take_output(poll.value);
+            (*m_callback)(std::move(output));
+        }
+        return poll.status;
+    }
+
+    void drop_future() noexcept override {
+        m_timers.cancel(m_deadline);
+        m_future.reset();
+        m_callback.reset();
+        m_on_expired.reset();
+    }
+
+private:
+    std::optional<RustFuture<T>> m_future;
+    std::optional<std::decay_t<F>> m_callback;
+    std::optional<std::decay_t<E>> m_on_expired;
+    TimerWheel& m_timers;
+    TimerEntry m_deadline;
+    bool m_registered{false};
 };
 
 }  // namespace detail
 
+struct ExecutorOptions {
+    // Number of threads polling the tasks. With zero threads, tasks are polled on the thread
+    // running the io_context, otherwise on a work-stealing pool owned by the executor.
+    std::size_t worker_threads{0};
+    // Tasks polled before other work gets a turn. Without workers, every io_context handler of
+    // the executor polls at most this many tasks, so I/O completions queued in the meantime run
+    // in between. With workers, a worker takes a task woken by another thread after this many
+    // tasks from its own queue.
+    std::size_t max_polls_per_tick{64};
+    // Futures a coroutine task polls within one poll of the task. Once the budget is used up,
+    // the task is queued again and the next awaited future is polled by its next poll, so a
+    // coroutine awaiting futures which are always ready does not keep the thread. A Rust future
+    // which loops within its own poll cannot be interrupted this way, it has to yield itself.
+    std::size_t poll_budget{128};
+    // polls of tasks which waited longer than this since they were woken are counted as starved
+    std::chrono::steady_clock::duration starvation_threshold{std::chrono::milliseconds{10}};
+};
+
 class Executor {
 public:
-    Executor(boost::asio::io_context& ioCtx);
+    Executor(boost::asio::io_context& ioCtx, ExecutorOptions options = {});
+    ~Executor();
 
+    Executor(Executor const&) = delete;
+    Executor& operator=(Executor const&) = delete;
+
+    // The callback is invoked on the thread which polled the task to completion, with the output
+    // of the future or, for an FfiResult<T>, with std::expected<T, Error>.
     template <typename T, typename F>
-    void await(RustFuture<T> future, F&& callback) {
-        auto task = std::make_shared<detail::Task<T, F>>(
-            std::move(future), std::forward<F>(callback), *this, m_last_task_id++);
-        auto done = task->poll(*this);
-        if (!done) {
-            m_tasks.emplace_back(std::move(task));
-        }
+    TaskHandle await(RustFuture<T> future, F&& callback) {
+        return spawn<detail::Task<T, F>>(std::move(future), std::forward<F>(callback));
+    }
+
+    // Like await(), but if the future did not finish before the deadline, it is dropped and
+    // on_expired is invoked without arguments instead of the callback.
+    template <typename T, typename F, typename E>
+    TaskHandle await_with_deadline(RustFuture<T> future,
+                                   std::chrono::steady_clock::time_point deadline,
+                                   F&& callback,
+                                   E&& on_expired) {
+        return spawn<detail::DeadlineTask<T, F, E>>(std::move(future), m_timers, deadline,
+                                                    std::forward<F>(callback),
+                                                    std::forward<E>(on_expired));
+    }
+
+    // Runs a coroutine from Coroutine.hpp, the callback is invoked with its result unless it threw.
+    template <typename T, typename F>
+    TaskHandle await(Lazy<T> coroutine, F&& callback) {
+        return spawn<detail::CoroutineTask<T, F>>(std::move(coroutine), std::forward<F>(callback));
+    }
+
+    // Polls the stream until it ends. The callback is invoked with every item on the thread which
+    // polled it, and returns false to stop early, which drops the stream.
+    template <typename T, typename F>
+    TaskHandle for_each(RustStream<T> stream, F&& callback) {
+        return spawn<detail::StreamTask<T, F>>(std::move(stream), std::forward<F>(callback));
+    }
+
+    // A future for Rust which is ready with true once the duration passed.
+    ::FfiFuture<bool> sleep(std::chrono::steady_clock::duration duration) {
+        return m_timers.sleep_until(std::chrono::steady_clock::now() + duration);
     }
 
     // used by the task when it was woken
     void ready(detail::TaskBase& task);
 
+    // used by TaskHandle::cancel()
+    void cancel(TaskId id);
+
+    MetricsSnapshot metrics() const;
+
 private:
-    std::vector<std::shared_ptr<detail::TaskBase>> m_tasks{};
+    friend class detail::TaskBase;
+
+    template <typename Task, typename... Args>
+    TaskHandle spawn(Args&&... args) {
+        detail::TaskBase* task;
+        {
+            std::lock_guard lock{m_mutex};
+            task = &m_tasks.emplace<Task>(std::forward<Args>(args)..., *this);
+            local_metrics().tasks_spawned.fetch_add(1, std::memory_order_relaxed);
+            if (m_active++ == 0) {
+                // keep the io_context running while tasks are pending
+                m_work.emplace(m_ioctx.get_executor());
+            }
+        }
+        // the task may be gone once it ran
+        auto id = task->get_id();
+        if (m_pool) {
+            // no waker was handed out yet, so the task cannot be scheduled already
+            static_cast<void>(task->schedule());
+            m_pool->submit(*task);
+        } else {
+            run(*task);
+        }
+        return TaskHandle{*this, id};
+    }
+
+    void drain();
+    void run(detail::TaskBase& task);
+    // frees a finished task once the last waker was dropped
+    void free(detail::TaskBase& task) noexcept;
+
+    // metrics of the current thread
+    detail::MetricsShard& local_metrics() noexcept;
+
+    mutable std::mutex m_mutex{};
+    detail::TaskTable m_tasks{};
+    // number of unfinished tasks, the io_context is kept running while it is not zero
+    std::size_t m_active{0};
+    std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>>
+        m_work{};
     boost::asio::io_context& m_ioctx;
-    uint64_t m_last_task_id = 0;
+    std::size_t m_max_polls_per_tick;
+    std::size_t m_poll_budget;
+    std::int64_t m_starvation_threshold_ns;
+    detail::TimerWheel m_timers;
+    std::unique_ptr<detail::WorkerPool> m_pool{};
+    detail::Metrics m_metrics;
+
+    // single-threaded mode: tasks to poll in the next drain() handler
+    detail::ReadyQueue m_ready{};
+    std::atomic<std::size_t> m_ready_depth{0};
+    std::atomic<bool> m_drain_posted{false};
 };
 
 template <typename T>
@@ -176,16 +558,14 @@ template <typename T>
 namespace detail {
 
 template <typename T, typename F>
-class FutureImpl {
+class FutureImpl : public PoolAllocated {
 public:
     FutureImpl(F&& f) : m_func{std::forward<F>(f)} {}
 
     static ::FfiPoll<T> poll(void* self, ::FfiContext* context) {
-        std::cout << "+++ [C] called  CppFuture " << self << " with context "
-                  << reinterpret_cast<void*>(context) << ", waker "
-                  << reinterpret_cast<void const*>(context->waker) << ", vtable "
-                  << reinterpret_cast<void const*>(context->waker->vtable) << ", wake func "
-                  << reinterpret_cast<void const*>(context->waker->vtable->wake) << std::endl;
+        ASYNCRT_TRACE(Future, Debug, "called CppFuture ", self, " with context ",
+                      static_cast<void const*>(context), ", waker ",
+                      static_cast<void const*>(context->waker));
         return static_cast<FutureImpl*>(self)->poll_impl(context);
     }
 
@@ -198,8 +578,10 @@ private:
     ::FfiPoll<T> poll_impl(::FfiContext* ctx) {
         try {
             return m_func(ctx);
+        } catch (std::exception const& err) {
+            return make_failed_poll<T>(ErrorCode::Internal, err.what());
         } catch (...) {
-            return make_poll_status<T>(PollStatus::Panicked);
+            return make_failed_poll<T>(ErrorCode::Internal, "unknown exception");
         }
     }
 
@@ -211,7 +593,7 @@ private:
 template <typename T, typename F>
 ::FfiFuture<T> make_cpp_future(F&& f) {
     auto* future = new detail::FutureImpl<T, F>{std::forward<F>(f)};
-    std::cout << "+++ [C] CPP FutureImpl    " << reinterpret_cast<void*>(future) << std::endl;
+    ASYNCRT_TRACE(Future, Debug, "created CppFuture ", static_cast<void const*>(future));
     return ::FfiFuture<T>{
         future,
         &detail::FutureImpl<T, F>::poll,
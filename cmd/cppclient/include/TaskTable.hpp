@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace asyncrt {
+
+/**
+ * Identifies a task of an executor. The lower half is the index of the slot in the task table,
+ * the upper half the generation of that slot, so an id of a finished task never matches a task
+ * which later reuses the same slot.
+ */
+class TaskId {
+public:
+    constexpr TaskId() noexcept = default;
+    constexpr TaskId(std::uint32_t index, std::uint32_t generation) noexcept
+        : m_value{(std::uint64_t{generation} << 32) | index} {}
+
+    constexpr std::uint32_t index() const noexcept { return static_cast<std::uint32_t>(m_value); }
+
+    constexpr std::uint32_t generation() const noexcept {
+        return static_cast<std::uint32_t>(m_value >> 32);
+    }
+
+    constexpr std::uint64_t value() const noexcept { return m_value; }
+
+    friend constexpr bool operator==(TaskId, TaskId) noexcept = default;
+
+private:
+    // generation 0 is never used, so a default constructed id is always invalid
+    std::uint64_t m_value{0};
+};
+
+std::ostream& operator<<(std::ostream& os, TaskId id);
+
+namespace detail {
+
+class TaskBase;
+
+/**
+ * Generational slab storing the tasks of an executor.
+ *
+ * Slots are allocated in chunks which are never moved, so a task keeps its address for its whole
+ * lifetime. Tasks which fit into a slot are constructed in place, larger ones are allocated
+ * separately. Insertion, lookup and removal are O(1); freed slots are recycled through an
+ * intrusive free list.
+ */
+class TaskTable {
+public:
+    static constexpr std::size_t kInlineSize = 256;
+    static constexpr std::uint32_t kChunkSize = 256;
+
+    TaskTable() = default;
+    TaskTable(TaskTable const&) = delete;
+    ~TaskTable();
+
+    TaskTable& operator=(TaskTable const&) = delete;
+
+    // Constructs a task in a free slot. The id of the slot is passed as last constructor argument.
+    template <typename Task, typename... Args>
+    Task& emplace(Args&&... args) {
+        auto index = acquire_slot();
+        auto& slot = get_slot(index);
+        auto id = TaskId{index, slot.generation};
+        try {
+            Task* task;
+            if constexpr (sizeof(Task) <= kInlineSize && alignof(Task) <= alignof(Slot)) {
+                task = ::new (static_cast<void*>(slot.storage))
+                    Task{std::forward<Args>(args)..., id};
+                slot.is_inline = true;
+            } else {
+                task = new Task{std::forward<Args>(args)..., id};
+                slot.is_inline = false;
+            }
+            slot.task = task;
+            ++m_size;
+            return *task;
+        } catch (...) {
+            release_slot(index);
+            throw;
+        }
+    }
+
+    // Calls f for every task in the table, f may erase tasks.
+    template <typename F>
+    void for_each(F&& f) {
+        for (std::uint32_t index = 0; index < m_capacity; ++index) {
+            if (auto* task = get_slot(index).task) {
+                f(*task);
+            }
+        }
+    }
+
+    // Returns the task with the given id, or nullptr if it was already removed.
+    [[nodiscard]] TaskBase* get(TaskId id) const noexcept;
+
+    // Destroys the task with the given id. Unknown ids are ignored.
+    void erase(TaskId id) noexcept;
+
+    std::size_t size() const noexcept { return m_size; }
+
+private:
+    static constexpr std::uint32_t kNoSlot = UINT32_MAX;
+
+    struct Slot {
+        alignas(std::max_align_t) std::byte storage[kInlineSize];
+        TaskBase* task{nullptr};
+        std::uint32_t generation{1};
+        std::uint32_t next_free{kNoSlot};
+        bool is_inline{false};
+    };
+
+    Slot& get_slot(std::uint32_t index) const noexcept {
+        return m_chunks[index / kChunkSize][index % kChunkSize];
+    }
+
+    std::uint32_t acquire_slot();
+    void release_slot(std::uint32_t index) noexcept;
+    void destroy(Slot& slot) noexcept;
+
+    std::vector<std::unique_ptr<Slot[]>> m_chunks{};
+    std::uint32_t m_free_head{kNoSlot};
+    std::uint32_t m_capacity{0};
+    std::size_t m_size{0};
+};
+
+}  // namespace detail
+}  // namespace asyncrt
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "ffi/future.h"
+
+namespace asyncrt {
+namespace detail {
+
+class TimerWheel;
+
+/**
+ * A deadline which can be registered with a TimerWheel. The entry is owned by the future waiting
+ * for it, which has to cancel it before the entry is destroyed.
+ */
+class TimerEntry {
+public:
+    explicit TimerEntry(std::chrono::steady_clock::time_point deadline) noexcept
+        : m_deadline{deadline} {}
+    TimerEntry(TimerEntry const&) = delete;
+    TimerEntry& operator=(TimerEntry const&) = delete;
+
+    std::chrono::steady_clock::time_point deadline() const noexcept { return m_deadline; }
+
+    // true once the deadline passed while the entry was registered
+    bool expired() const noexcept { return m_expired.load(std::memory_order_acquire); }
+
+private:
+    friend class TimerWheel;
+
+    static constexpr std::uint16_t kUnlinked = 0xffff;
+
+    std::chrono::steady_clock::time_point m_deadline;
+
+    // guarded by the mutex of the wheel
+    std::uint64_t m_tick{0};
+    TimerEntry* m_prev{nullptr};
+    TimerEntry* m_next{nullptr};
+    std::uint16_t m_slot{kUnlinked};
+    ::FfiWakerBase const* m_waker{nullptr};
+
+    std::atomic<bool> m_expired{false};
+};
+
+/**
+ * Hierarchical timer wheel with a resolution of one millisecond. Four levels of 64 slots cover
+ * deadlines up to 2^24 ms (about 4.6 hours) ahead, later ones wait in an overflow list. Entries
+ * are kept in intrusive lists, so registering and cancelling them is O(1). When the slot of a
+ * higher level comes up, its entries move down to the slots of the lower levels.
+ *
+ * A single steady_timer on the io_context is armed for the next slot while entries are
+ * registered, so the io_context keeps running until they expired or were cancelled. Entries may
+ * be registered and cancelled from any thread, the io_context must be run by a single thread.
+ */
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimerWheel(boost::asio::io_context& ioctx);
+    TimerWheel(TimerWheel const&) = delete;
+    TimerWheel& operator=(TimerWheel const&) = delete;
+
+    // Registers the waker of the context to be woken once the deadline of the entry passed,
+    // replacing the waker of an earlier poll. Returns true if it passed, the entry is not
+    // registered anymore then.
+    bool poll(TimerEntry& entry, ::FfiContext* context);
+
+    // Unregisters the entry and drops its waker, unless it expired already.
+    void cancel(TimerEntry& entry) noexcept;
+
+    // A future for Rust which is ready with true once the deadline passed.
+    ::FfiFuture<bool> sleep_until(Clock::time_point deadline);
+
+    // registered entries
+    std::size_t pending() const;
+    // entries whose deadline passed while they were registered
+    std::uint64_t expired() const;
+
+private:
+    static constexpr unsigned kSlotBits = 6;
+    static constexpr std::size_t kSlots = std::size_t{1} << kSlotBits;
+    static constexpr std::size_t kLevels = 4;
+    // index of the overflow list, behind the slots of all levels
+    static constexpr std::uint16_t kOverflow = kLevels * kSlots;
+    static constexpr std::uint64_t kNever = ~std::uint64_t{0};
+
+    // the first tick at or after the deadline
+    std::uint64_t deadline_tick(Clock::time_point deadline) const noexcept;
+    // the last tick at or before now
+    std::uint64_t current_tick(Clock::time_point now) const noexcept;
+    Clock::time_point time_of(std::uint64_t tick) const noexcept;
+
+    void link(TimerEntry& entry) noexcept;
+    void unlink(TimerEntry& entry) noexcept;
+    // the list whose entries are due next and the tick when they are due
+    std::optional<std::pair<std::uint16_t, std::uint64_t>> next_due() const noexcept;
+    // Expires the entries due until now, their wakers are appended to woken.
+    void advance(std::uint64_t now, std::vector<::FfiWakerBase const*>& woken);
+
+    // Arms the timer for the next due list, only called on the thread running the io_context.
+    void arm();
+    // Posts a handler calling arm(), unless one is posted already.
+    void request_arm();
+    void on_timer();
+
+    boost::asio::io_context& m_ioctx;
+    boost::asio::steady_timer m_timer;
+    Clock::time_point m_start;
+
+    mutable std::mutex m_mutex{};
+    std::array<TimerEntry*, kOverflow + 1> m_lists{};
+    // one bit per non-empty slot of every level
+    std::array<std::uint64_t, kLevels> m_occupied{};
+    // the tick up to which the entries expired
+    std::uint64_t m_elapsed{0};
+    std::size_t m_pending{0};
+    std::uint64_t m_expired{0};
+    // the tick the timer is armed for
+    std::uint64_t m_armed{kNever};
+    bool m_arm_posted{false};
+};
+
+}  // namespace detail
+}  // namespace asyncrt
@@ -0,0 +1,103 @@
+#pragma once
+// Tracing for the hot paths of the runtime.
+//
+// Trace points are written with ASYNCRT_TRACE(Category, Level, args...), the arguments are
+// streamed into a fixed-size line. Tracing is compiled in unless NDEBUG is defined, this can be
+// overridden by defining ASYNCRT_TRACING to 0 or 1. Without tracing, trace points generate no
+// code and their arguments are not evaluated.
+//
+// At runtime, trace points can be filtered by level and category. Lines are either written to
+// stderr or into a lock-free ring buffer, which is only printed on demand by dump().
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <span>
+#include <spanstream>
+#include <string_view>
+
+#ifndef ASYNCRT_TRACING
+#ifdef NDEBUG
+#define ASYNCRT_TRACING 0
+#else
+#define ASYNCRT_TRACING 1
+#endif
+#endif
+
+#define ASYNCRT_TRACE(category, level, ...)                                               \
+    do {                                                                                  \
+        if constexpr (::asyncrt::trace::kEnabled) {                                       \
+            if (::asyncrt::trace::enabled(::asyncrt::trace::Category::category,           \
+                                          ::asyncrt::trace::Level::level)) {              \
+                ::asyncrt::trace::write(::asyncrt::trace::Category::category,             \
+                                        ::asyncrt::trace::Level::level, __VA_ARGS__);     \
+            }                                                                             \
+        }                                                                                 \
+    } while (false)
+
+namespace asyncrt {
+namespace trace {
+
+inline constexpr bool kEnabled = ASYNCRT_TRACING != 0;
+
+enum class Level : std::uint8_t {
+    Debug,
+    Info,
+    Warning,
+    Error,
+};
+
+enum class Category : std::uint8_t {
+    Executor,
+    Task,
+    Waker,
+    Future,
+    Data,
+};
+
+enum class Sink : std::uint8_t {
+    // every line is written to stderr right away
+    Stderr,
+    // lines are kept in a ring buffer until dump() is called
+    Ring,
+};
+
+std::string_view to_string(Level level) noexcept;
+std::string_view to_string(Category category) noexcept;
+
+void set_level(Level level) noexcept;
+void enable(Category category, bool enabled = true) noexcept;
+void set_sink(Sink sink);
+
+// Writes the lines in the ring buffer to os, oldest first, and clears the buffer.
+void dump(std::ostream& os);
+
+namespace detail {
+
+// longest line, longer lines are truncated
+inline constexpr std::size_t kLineSize = 160;
+
+inline std::atomic<std::uint32_t> g_categories{~std::uint32_t{0}};
+inline std::atomic<Level> g_level{Level::Debug};
+
+void emit(Category category, Level level, std::string_view line) noexcept;
+
+}  // namespace detail
+
+inline bool enabled(Category category, Level level) noexcept {
+    return level >= detail::g_level.load(std::memory_order_relaxed) &&
+           (detail::g_categories.load(std::memory_order_relaxed) &
+            (std::uint32_t{1} << static_cast<unsigned>(category))) != 0;
+}
+
+template <typename... Args>
+void write(Category category, Level level, Args const&... args) {
+    char buffer[detail::kLineSize];
+    std::ospanstream os{std::span<char>{buffer}};
+    (os << ... << args);
+    detail::emit(category, level, std::string_view{os.span().data(), os.span().size()});
+}
+
+}  // namespace trace
+}  // namespace asyncrt
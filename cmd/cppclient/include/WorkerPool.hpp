@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace asyncrt {
+namespace detail {
+
+class TaskBase;
+
+/**
+ * Fixed set of worker threads running tasks of a multi-threaded executor.
+ *
+ * Every worker owns a local run queue. Tasks submitted from a worker end up in its own queue,
+ * tasks submitted from other threads in a shared injection queue. A worker without local work
+ * first takes from the injection queue and then steals half of the queue of another worker.
+ *
+ * After local_budget tasks in a row from its own queue, a worker checks the injection queue
+ * first, so tasks woken by other threads, e.g. by I/O completions, are not starved by local tasks
+ * which keep waking each other.
+ */
+class WorkerPool {
+public:
+    WorkerPool(std::size_t threads, std::function<void(TaskBase&)> run, std::size_t local_budget);
+    WorkerPool(WorkerPool const&) = delete;
+    ~WorkerPool();
+
+    WorkerPool& operator=(WorkerPool const&) = delete;
+
+    void submit(TaskBase& task);
+
+    std::size_t size() const noexcept { return m_workers.size(); }
+
+    // number of tasks waiting in the queues
+    std::size_t queued() const noexcept { return m_queued.load(std::memory_order_relaxed); }
+
+    // times a worker took a task from the injection queue because its budget was used up
+    std::uint64_t budget_yields() const noexcept {
+        return m_budget_yields.load(std::memory_order_relaxed);
+    }
+
+    // index of the worker running on the calling thread, if any
+    std::optional<std::size_t> current_worker() const noexcept;
+
+private:
+    struct Worker {
+        std::mutex mutex{};
+        std::deque<TaskBase*> queue{};
+        std::thread thread{};
+        // tasks taken from the own queue in a row, only accessed by the worker
+        std::size_t local_runs{0};
+    };
+
+    void work(std::size_t index);
+    TaskBase* next(std::size_t index);
+    TaskBase* steal(std::size_t index);
+    TaskBase* take_injected();
+
+    std::vector<std::unique_ptr<Worker>> m_workers{};
+    std::function<void(TaskBase&)> m_run;
+    std::size_t m_local_budget;
+
+    std::mutex m_mutex{};
+    std::condition_variable m_wakeup{};
+    std::deque<TaskBase*> m_injected{};
+    bool m_stopping{false};
+
+    // number of tasks in all queues, idle workers sleep while it is zero
+    std::atomic<std::size_t> m_queued{0};
+    std::atomic<std::uint64_t> m_budget_yields{0};
+};
+
+}  // namespace detail
+}  // namespace asyncrt
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+#include "Runtime.hpp"
+#include "mylib.hpp"
+
+namespace mylib {
+namespace detail {
+
+struct Cache;
+
+}  // namespace detail
+
+struct CacheOptions {
+    // how long a response is fresh after it was fetched
+    std::chrono::steady_clock::duration ttl{std::chrono::minutes{1}};
+    // how long a response is still returned after it went stale, while it is fetched again
+    std::chrono::steady_clock::duration stale_while_revalidate{std::chrono::minutes{5}};
+    // bound of the cached bytes, the least recently used responses are evicted first
+    std::size_t max_bytes{16 * 1024 * 1024};
+    // a background refresh is given up after this, the next request for the key starts another
+    std::chrono::steady_clock::duration refresh_timeout{std::chrono::seconds{30}};
+};
+
+/**
+ * Caches the responses of a data access by key. Cached responses are handed out without copying
+ * them and are ready on the first poll. Stale responses are returned while the executor fetches
+ * them again in the background.
+ */
+class CachingDataAccess : public DataAccess {
+public:
+    CachingDataAccess(std::unique_ptr<DataAccess> data_access,
+                      asyncrt::Executor& executor,
+                      CacheOptions options = {});
+    ~CachingDataAccess() override;
+
+    ::FfiFuture<DataResult> get_data(std::string_view key) override;
+    ::FfiFuture<bool> sleep(std::chrono::nanoseconds duration) override;
+
+private:
+    void refresh(std::string_view key);
+
+    std::unique_ptr<DataAccess> m_data_access;
+    asyncrt::Executor& m_executor;
+    std::chrono::steady_clock::duration m_refresh_timeout;
+    // shared with pending requests, which may finish after this object is gone
+    std::shared_ptr<detail::Cache> m_cache;
+};
+
+}  // namespace mylib
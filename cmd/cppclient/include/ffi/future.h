@@ -2,6 +2,13 @@
 
 #include <stdint.h>
 
+#include <type_traits>
+
+// Values which cross the FFI by value. They are copied bitwise and never destroyed by the side
+// which received them, owning values carry the function which frees them.
+template<typename T>
+concept FfiValue = std::is_trivially_copyable_v<T> && std::is_standard_layout_v<T>;
+
 struct FfiWakerBase;
 
 struct FfiWakerVTable {
@@ -25,7 +32,8 @@ enum class PollStatus : uint8_t {
     Panicked,
 };
 
-template<typename T>
+// Layout of async_ffi::FfiPoll<T>, a Rust enum with #[repr(C, u8)], see ffi/layout.h.
+template<FfiValue T>
 struct FfiPoll {
     PollStatus status;
     // the value is only present if the PollStatus is Ready,
@@ -35,7 +43,7 @@ struct FfiPoll {
     };
 };
 
-template<typename T>
+template<FfiValue T>
 struct FfiFuture {
     void *fut_ptr;
     struct FfiPoll<T> (*poll_fn)(void *, struct FfiContext *);
@@ -0,0 +1,62 @@
+#pragma once
+// Compile-time checks that the C++ mirrors of the FFI types have the layout of their Rust
+// definitions. A Rust enum with #[repr(C, u8)] is a u8 tag followed by a union of its variants,
+// aligned for the most aligned one, and padded to a multiple of that alignment.
+
+#include <stddef.h>
+
+#include <algorithm>
+
+#include "future.h"
+#include "result.h"
+#include "stream.h"
+
+namespace ffi_layout {
+
+constexpr size_t round_up(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+// offset of the payload of a tagged enum whose most aligned variant has the given alignment
+constexpr size_t payload_offset(size_t align) {
+    return round_up(1, align);
+}
+
+constexpr size_t enum_size(size_t size, size_t align) {
+    return round_up(payload_offset(align) + size, align);
+}
+
+template<typename T>
+constexpr bool poll_matches() {
+    using P = FfiPoll<T>;
+    return sizeof(PollStatus) == 1 && offsetof(P, status) == 0 &&
+           offsetof(P, value) == payload_offset(alignof(T)) &&
+           sizeof(P) == enum_size(sizeof(T), alignof(T)) && alignof(P) == alignof(T);
+}
+
+template<typename T>
+constexpr bool stream_poll_matches() {
+    using P = FfiStreamPoll<T>;
+    return sizeof(StreamPollStatus) == 1 && offsetof(P, status) == 0 &&
+           offsetof(P, value) == payload_offset(alignof(T)) &&
+           sizeof(P) == enum_size(sizeof(T), alignof(T));
+}
+
+template<typename T>
+constexpr bool result_matches() {
+    using R = FfiResult<T>;
+    constexpr size_t align = std::max(alignof(T), alignof(FfiError));
+    constexpr size_t size = std::max(sizeof(T), sizeof(FfiError));
+    return sizeof(FfiResultTag) == 1 && offsetof(R, tag) == 0 &&
+           offsetof(R, ok) == payload_offset(align) && offsetof(R, err) == payload_offset(align) &&
+           sizeof(R) == enum_size(size, align) && poll_matches<R>();
+}
+
+// the fields of an FfiError are laid out like those of a #[repr(C)] struct
+static_assert(sizeof(FfiErrorCode) == 1 && offsetof(FfiError, message) == alignof(char *) &&
+              sizeof(FfiError) == 3 * sizeof(void *));
+static_assert(poll_matches<bool>() && poll_matches<uint64_t>());
+static_assert(stream_poll_matches<uint8_t>());
+static_assert(result_matches<bool>());
+
+}  // namespace ffi_layout
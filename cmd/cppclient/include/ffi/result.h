@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "future.h"
+
+enum class FfiErrorCode : uint8_t {
+    // an error without a more specific code, e.g. a C++ exception
+    Internal,
+    InvalidPostcode,
+    // the data could not be parsed
+    InvalidData,
+    // the data could not be fetched
+    DataAccess,
+};
+
+// The message is owned by the error and freed with drop, it may be null.
+struct FfiError {
+    FfiErrorCode code;
+    char *message;
+    void (*drop)(char *);
+};
+
+enum class FfiResultTag : uint8_t {
+    Ok,
+    Err,
+};
+
+// Layout of a Rust enum FfiResult<T> with #[repr(C, u8)].
+template<FfiValue T>
+struct FfiResult {
+    FfiResultTag tag;
+    // only one of the values is present, depending on the tag
+    union {
+        T ok;
+        struct FfiError err;
+    };
+};
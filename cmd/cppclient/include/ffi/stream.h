@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "future.h"
+
+enum class StreamPollStatus : uint8_t {
+    Ready,
+    Pending,
+    Panicked,
+    // the stream ended, no value is present
+    Done,
+};
+
+template<FfiValue T>
+struct FfiStreamPoll {
+    StreamPollStatus status;
+    // the value is only present if the StreamPollStatus is Ready,
+    // so wrap it in a union
+    union {
+        T value;
+    };
+};
+
+// Produces any number of values, polling it again after Ready yields the next one.
+template<FfiValue T>
+struct FfiStream {
+    void *stream_ptr;
+    struct FfiStreamPoll<T> (*poll_next_fn)(void *, struct FfiContext *);
+    void (*drop_fn)(void *);
+};
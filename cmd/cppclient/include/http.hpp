@@ -2,12 +2,25 @@
 // Adapted from the Boost.Beast SSL client example:
 // https://www.boost.org/doc/libs/1_74_0/libs/beast/example/http/client/async-ssl/http_client_async_ssl.cpp
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/beast/core/error.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/core/tcp_stream.hpp>
 #include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/message.hpp>
@@ -16,35 +29,218 @@
 #include <boost/beast/ssl.hpp>
 
 namespace http {
+
+// Parts of a URL, pointing into the parsed string.
+struct Url {
+    std::string_view scheme{};
+    std::string_view host{};
+    // the default port of the scheme if the URL has none
+    std::string_view port{};
+    // path and query
+    std::string_view target{};
+};
+
+// Parses an absolute http or https URL. Returns std::nullopt for other schemes, URLs with
+// credentials and malformed URLs.
+std::optional<Url> parse_url(std::string_view url);
+
+struct PoolOptions {
+    // idle connections kept open per host
+    std::size_t max_idle_per_host{4};
+    // open connections per host, further requests wait until a connection is released
+    std::size_t max_per_host{8};
+    // idle connections are closed once they were not used for this long
+    std::chrono::steady_clock::duration idle_timeout{std::chrono::seconds{30}};
+};
+
+struct ResolverOptions {
+    // how long resolved addresses are used
+    std::chrono::steady_clock::duration ttl{std::chrono::seconds{60}};
+    // addresses used within this time before they expire are resolved again in the background
+    std::chrono::steady_clock::duration refresh_ahead{std::chrono::seconds{10}};
+};
+
+// Why a request failed, passed to the response callback instead of a body.
+struct RequestError {
+    boost::beast::error_code code;
+    // the step which failed, e.g. "failed to connect"
+    std::string_view what;
+
+    // the step and the message of the error code
+    std::string message() const;
+};
+
 namespace detail {
 
+using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+/**
+ * A TLS connection to a host, which is kept open between requests if the server allows it.
+ */
+struct Connection {
+    Connection(Strand const& strand, std::string host, std::string port);
+
+    std::string host;
+    std::string port;
+    // host and port, connections are pooled by origin
+    std::string origin;
+    boost::beast::ssl_stream<boost::beast::tcp_stream> stream;
+    // may hold data read past the end of the previous response
+    boost::beast::flat_buffer buffer{};
+    // false until the TLS handshake completed
+    bool connected{false};
+    // true once a response was read, the server may have closed the connection since
+    bool reused{false};
+    std::chrono::steady_clock::time_point idle_since{};
+};
+
+/**
+ * Keeps connections open per host, so requests to the same host can skip connecting and the TLS
+ * handshake. The pool is only accessed on its strand, and the sessions using its connections run
+ * their I/O on that strand as well.
+ *
+ * Idle connections are closed when the pool is used after their idle timeout passed, rather than
+ * by a timer, so an idle pool does not keep the io_context running.
+ */
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool> {
+public:
+    using Handler = std::function<void(std::unique_ptr<Connection>)>;
+    // identifies a request waiting for a connection
+    using Ticket = std::uint64_t;
+
+    ConnectionPool(boost::asio::io_context& io_context, PoolOptions options);
+    ConnectionPool(ConnectionPool const&) = delete;
+    ~ConnectionPool();
+
+    ConnectionPool& operator=(ConnectionPool const&) = delete;
+
+    Strand const& get_executor() const noexcept { return m_strand; }
+
+    // Calls the handler on the strand with an idle connection to the host, or with a new one
+    // which still has to be connected. With fresh set, idle connections to the host are closed
+    // instead of being used. The ticket can be passed to cancel() while the request waits for a
+    // connection.
+    Ticket acquire(std::string host, std::string port, Handler handler, bool fresh = false);
+
+    // Destroys the handler of a request still waiting for a connection, so it leaves the queue of
+    // its host right away. Only called on the strand.
+    void cancel(Ticket ticket);
+
+    // Hands a connection back after a request. Connections which are not reusable are closed.
+    void release(std::unique_ptr<Connection> connection, bool reusable);
+
+private:
+    struct Waiter {
+        Ticket ticket;
+        Handler handler;
+    };
+
+    struct Host {
+        std::deque<std::unique_ptr<Connection>> idle{};
+        // requests waiting for a connection
+        std::deque<Waiter> waiting{};
+        // idle connections and connections in use
+        std::size_t open{0};
+    };
+
+    void do_acquire(std::string const& host,
+                    std::string const& port,
+                    Ticket ticket,
+                    Handler handler,
+                    bool fresh);
+    void do_release(std::unique_ptr<Connection> connection, bool reusable);
+    void close_expired(std::chrono::steady_clock::time_point now);
+
+    Strand m_strand;
+    PoolOptions m_options;
+    std::unordered_map<std::string, Host> m_hosts{};
+    std::atomic<Ticket> m_next_ticket{0};
+};
+
+/**
+ * Caches resolved addresses per host. Concurrent lookups of a host share a single resolve, and
+ * addresses which are about to expire are refreshed in the background when they are used, so
+ * requests to a host in use do not wait for DNS. Like the connection pool, the cache is only
+ * accessed on its strand.
+ */
+class ResolverCache : public std::enable_shared_from_this<ResolverCache> {
+public:
+    using Results = boost::asio::ip::tcp::resolver::results_type;
+    using Handler = std::function<void(boost::beast::error_code, Results)>;
+
+    ResolverCache(Strand const& strand, ResolverOptions options);
+    ResolverCache(ResolverCache const&) = delete;
+    ~ResolverCache();
+
+    ResolverCache& operator=(ResolverCache const&) = delete;
+
+    // Calls the handler on the strand with the addresses of the host.
+    void resolve(std::string host, std::string port, Handler handler);
+
+    // Drops the addresses of the host, e.g. because connecting to them failed.
+    void invalidate(std::string const& host, std::string const& port);
+
+private:
+    struct Entry {
+        Results results{};
+        std::chrono::steady_clock::time_point expires{};
+        std::vector<Handler> waiting{};
+        bool resolving{false};
+    };
+
+    void do_resolve(std::string const& host, std::string const& port, Handler handler);
+    void start(std::string const& origin, std::string const& host, std::string const& port);
+    void on_resolve(std::string const& origin, boost::beast::error_code ec, Results results);
+
+    Strand m_strand;
+    ResolverOptions m_options;
+    boost::asio::ip::tcp::resolver m_resolver;
+    std::unordered_map<std::string, Entry> m_entries{};
+};
+
 class SessionBase : public std::enable_shared_from_this<SessionBase> {
+public:
+    // Aborts the request from any thread, unless its response arrived already.
+    void cancel();
+
 protected:
-    explicit SessionBase(boost::asio::io_context& io_context);
+    SessionBase(std::shared_ptr<ConnectionPool> pool, std::shared_ptr<ResolverCache> resolver);
     virtual ~SessionBase();
 
     void initiate_request(boost::beast::http::verb method,
                           std::string const& host,
+                          std::string const& port,
                           std::string const& target);
 
-    virtual void on_error() = 0;
-    virtual void on_result(std::string const& result) = 0;
+    virtual void on_error(RequestError const& error) = 0;
+    // the body of the response is moved out, so it reaches the callback without being copied
+    virtual void on_result(std::string&& result) = 0;
 
 private:
+    void on_connection(std::unique_ptr<Connection> connection);
     void on_resolve(boost::beast::error_code ec,
                     boost::asio::ip::tcp::resolver::results_type results);
     void on_connect(boost::beast::error_code ec,
                     boost::asio::ip::tcp::resolver::results_type::endpoint_type);
     void on_handshake(boost::beast::error_code ec);
+    void write();
     void on_write(boost::beast::error_code ec, std::size_t bytes_transferred);
     void on_read(boost::beast::error_code ec, std::size_t bytes_transferred);
     void on_shutdown(boost::beast::error_code ec);
+    void fail(boost::beast::error_code ec, std::string_view what);
+    void do_cancel();
+    // Closes the connection of a cancelled request, returns false if it was not cancelled.
+    bool abort_if_cancelled();
 
-    boost::asio::ip::tcp::resolver m_resolver;
-    boost::beast::ssl_stream<boost::beast::tcp_stream> m_stream;
-    boost::beast::flat_buffer m_buffer;
+    std::shared_ptr<ConnectionPool> m_pool;
+    std::unique_ptr<Connection> m_connection{};
+    std::shared_ptr<ResolverCache> m_resolver;
     boost::beast::http::request<boost::beast::http::empty_body> m_request;
     boost::beast::http::response<boost::beast::http::string_body> m_response;
+    bool m_retried{false};
+    // only accessed on the strand of the pool, or before the request is started
+    bool m_cancelled{false};
+    ConnectionPool::Ticket m_ticket{0};
 };
 
 }  // namespace detail
@@ -52,32 +248,91 @@ private:
 template <typename Callback>
 class Session : public detail::SessionBase {
 public:
-    Session(boost::asio::io_context& io_context, Callback&& callback)
-        : detail::SessionBase{io_context}, m_callback{std::forward<Callback>(callback)} {}
+    Session(std::shared_ptr<detail::ConnectionPool> pool,
+            std::shared_ptr<detail::ResolverCache> resolver,
+            Callback&& callback)
+        : detail::SessionBase{std::move(pool), std::move(resolver)},
+          m_callback{std::forward<Callback>(callback)} {}
     ~Session() override = default;
 
-    void get(std::string const& host, std::string const& target) {
-        initiate_request(boost::beast::http::verb::get, host, target);
+    void get(std::string const& host, std::string const& port, std::string const& target) {
+        initiate_request(boost::beast::http::verb::get, host, port, target);
     }
 
 protected:
-    void on_error() override {
-        // TODO
-    }
+    void on_error(RequestError const& error) override { m_callback(error); }
 
-    void on_result(std::string const& result) override { m_callback(result); }
+    void on_result(std::string&& result) override { m_callback(std::move(result)); }
 
 private:
     Callback m_callback;
 };
 
-template <typename F>
-void get(boost::asio::io_context& io_context,
-         std::string const& host,
-         std::string const& target,
-         F&& response_callback) {
-    auto client = std::make_shared<Session<F>>(io_context, std::forward<F>(response_callback));
-    client->get(host, target);
-}
+/**
+ * Cancels a request of a Client. The pending operation of a cancelled request is aborted and its
+ * connection closed, a connection it did not use yet goes back to the pool. The callback is
+ * destroyed without being called, unless the response arrived already.
+ */
+class RequestHandle {
+public:
+    RequestHandle() noexcept = default;
+    explicit RequestHandle(std::weak_ptr<detail::SessionBase> session) noexcept
+        : m_session{std::move(session)} {}
+
+    // Can be called from any thread, has no effect once the request finished.
+    void cancel() const {
+        if (auto session = m_session.lock()) {
+            session->cancel();
+        }
+    }
+
+private:
+    std::weak_ptr<detail::SessionBase> m_session;
+};
+
+/**
+ * HTTPS client reusing connections and resolved addresses across requests.
+ */
+class Client {
+public:
+    explicit Client(boost::asio::io_context& io_context,
+                    PoolOptions pool_options = {},
+                    ResolverOptions resolver_options = {})
+        : m_pool{std::make_shared<detail::ConnectionPool>(io_context, pool_options)},
+          m_resolver{
+              std::make_shared<detail::ResolverCache>(m_pool->get_executor(), resolver_options)} {}
+
+    // The callback is invoked with the body of the response as std::string&&, or with a
+    // RequestError if the request failed. It is not invoked for a cancelled request.
+    template <typename F>
+    RequestHandle get(std::string const& host, std::string const& target, F&& response_callback) {
+        auto session = std::make_shared<Session<F>>(m_pool, m_resolver,
+                                                    std::forward<F>(response_callback));
+        session->get(host, "443", target);
+        return RequestHandle{session};
+    }
+
+    // Throws std::invalid_argument for URLs which are not https.
+    template <typename F>
+    RequestHandle get(Url const& url, F&& response_callback) {
+        if (url.scheme != "https") {
+            throw std::invalid_argument{"only https URLs are supported"};
+        }
+        std::string target{};
+        // a query without path, e.g. https://host?query
+        if (url.target.starts_with('?')) {
+            target += '/';
+        }
+        target += url.target;
+        auto session = std::make_shared<Session<F>>(m_pool, m_resolver,
+                                                    std::forward<F>(response_callback));
+        session->get(std::string{url.host}, std::string{url.port}, target);
+        return RequestHandle{session};
+    }
+
+private:
+    std::shared_ptr<detail::ConnectionPool> m_pool;
+    std::shared_ptr<detail::ResolverCache> m_resolver;
+};
 
 }  // namespace http
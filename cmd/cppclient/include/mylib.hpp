@@ -1,64 +1,173 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <exception>
-#include <iostream>
+#include <functional>
 #include <memory>
+#include <span>
+#include <string>
+#include <string_view>
 
+#include "Result.hpp"
 #include "Runtime.hpp"
+#include "Trace.hpp"
 
 extern "C" {
 
-struct FfiDataHolder;
-
-typedef void (*FfiDataHolderDropFn)(const FfiDataHolder*);
-
+// Bytes handed to Rust by value. The owner keeps them alive until drop is called with it.
 struct FfiDataHolder {
     const std::uint8_t* ptr;
     std::size_t len;
-    FfiDataHolderDropFn drop;
+    void* owner;
+    void (*drop)(void* owner);
 };
 
 struct FfiLib;
 
+struct FfiShouldRunResults {
+    std::uint8_t* ptr;
+    std::size_t len;
+    void (*drop)(std::uint8_t*, std::size_t);
+};
+
 }  // extern "C"
 
 namespace mylib {
+namespace detail {
+
+// Hash for maps with std::string keys which can be looked up by std::string_view.
+struct StringHash {
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view key) const noexcept {
+        return std::hash<std::string_view>{}(key);
+    }
+};
+
+}  // namespace detail
+
+// Hands the bytes of a string to Rust without copying them.
+::FfiDataHolder make_data_holder(std::string data);
 
-class DataHolderBase : public ::FfiDataHolder {
+/**
+ * Data of a holder which is handed out several times, e.g. the result of a single request
+ * returned to several callers. Every handed out holder references the shared data, so handing
+ * one out does not allocate.
+ */
+class SharedData {
 public:
-    DataHolderBase(const std::uint8_t* ptr, std::size_t len)
-        : ::FfiDataHolder{
-              .ptr = ptr,
-              .len = len,
-              .drop = &DataHolderBase::free,
-          } {}
+    SharedData(SharedData const&) = delete;
+    SharedData& operator=(SharedData const&) = delete;
 
-    virtual ~DataHolderBase();
+    // A holder of the same bytes, which keeps them alive until Rust drops it.
+    ::FfiDataHolder hand_out() const noexcept;
+
+    std::size_t size() const noexcept { return m_data.len; }
 
 private:
-    static void free(const ::FfiDataHolder* self) {
-        std::cerr << "DataHolderBase::free" << std::endl;
-        const DataHolderBase* p = static_cast<const DataHolderBase*>(self);
-        delete p;
-    }
+    friend std::shared_ptr<SharedData const> share(::FfiDataHolder data);
+
+    explicit SharedData(::FfiDataHolder data) noexcept : m_data{data} {}
+    ~SharedData();
+
+    static void release(void* self) noexcept;
+
+    ::FfiDataHolder m_data;
+    // one for all shared_ptrs, and one per handed out holder
+    mutable std::atomic<std::size_t> m_refs{1};
 };
 
+// Takes over a data holder, it is dropped once the returned pointer and the holders handed out
+// from it are gone.
+std::shared_ptr<SharedData const> share(::FfiDataHolder data);
+
+// Output of DataAccess::get_data(). The code of an error is passed on to the callers of the
+// library, e.g. ErrorCode::DataAccess for data which could not be fetched.
+using DataResult = ::FfiResult<::FfiDataHolder>;
+
 class DataAccess {
 public:
     virtual ~DataAccess();
 
-    virtual ::FfiFuture<::FfiDataHolder*> get_data() = 0;
+    // The key is only valid until the call returns.
+    virtual ::FfiFuture<DataResult> get_data(std::string_view key) = 0;
+
+    // Returns a future which is ready once the duration passed, e.g. from Executor::sleep(). The
+    // library uses it to pace its streams.
+    virtual ::FfiFuture<bool> sleep(std::chrono::nanoseconds duration) = 0;
+};
+
+// Result of a single postcode of Lib::should_run_many().
+enum class ShouldRun : std::uint8_t {
+    No = 0,
+    Yes = 1,
+    // the postcode is invalid, or its data could not be fetched or parsed
+    Error = 2,
 };
 
+/**
+ * Owns the results of Lib::should_run_many(), one per postcode in the order of the postcodes.
+ */
+class ShouldRunResults {
+public:
+    explicit ShouldRunResults(::FfiShouldRunResults results) : m_results{results} {}
+    ShouldRunResults(ShouldRunResults&& other) noexcept : m_results{other.m_results} {
+        other.m_results.ptr = nullptr;
+    }
+    ShouldRunResults(ShouldRunResults const&) = delete;
+
+    ~ShouldRunResults() {
+        if (m_results.ptr != nullptr) {
+            m_results.drop(m_results.ptr, m_results.len);
+        }
+    }
+
+    ShouldRunResults& operator=(ShouldRunResults&&) = delete;
+    ShouldRunResults& operator=(ShouldRunResults const&) = delete;
+
+    std::size_t size() const noexcept { return m_results.len; }
+
+    ShouldRun operator[](std::size_t index) const noexcept {
+        return static_cast<ShouldRun>(m_results.ptr[index]);
+    }
+
+private:
+    ::FfiShouldRunResults m_results;
+};
+
+}  // namespace mylib
+
+// The executor and co_await hand out the results of Lib::should_run_many() as ShouldRunResults.
+template <>
+struct asyncrt::OutputTraits<::FfiShouldRunResults> {
+    using Output = mylib::ShouldRunResults;
+
+    static Output take(::FfiShouldRunResults& value) { return Output{value}; }
+};
+
+namespace mylib {
+
 class Lib {
 public:
     Lib(std::unique_ptr<DataAccess> data_access);
     ~Lib();
 
-    // postcode is checked by the library to keep the API surface smaller
-    asyncrt::RustFuture<bool> should_run(std::uint32_t postcode);
+    // The postcode is checked by the library to keep the API surface smaller, an invalid one
+    // fails with ErrorCode::InvalidPostcode.
+    asyncrt::RustFuture<::FfiResult<bool>> should_run(std::uint32_t postcode);
+
+    // Evaluates all postcodes with a single future. The postcodes are copied, the callback receives
+    // the results as ShouldRunResults.
+    asyncrt::RustFuture<::FfiShouldRunResults> should_run_many(
+        std::span<std::uint32_t const> postcodes);
+
+    // Evaluates the postcode right away and then again after every interval, until the stream is
+    // dropped. The interval is slept with DataAccess::sleep().
+    asyncrt::RustStream<ShouldRun> watch(std::uint32_t postcode,
+                                         std::chrono::milliseconds interval);
 
 private:
     ::FfiLib* m_mylib;
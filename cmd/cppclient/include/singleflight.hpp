@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string_view>
+
+#include "Runtime.hpp"
+#include "mylib.hpp"
+
+namespace mylib {
+namespace detail {
+
+struct Flight;
+struct Flights;
+
+}  // namespace detail
+
+/**
+ * Deduplicates concurrent requests for the same key. While a request for a key is in flight,
+ * further requests for that key wait for its result instead of reaching the wrapped data access,
+ * and all of them share the returned data.
+ */
+class SingleFlightDataAccess : public DataAccess {
+public:
+    // The executor polls the shared requests. A shared request which did not finish within the
+    // timeout fails for all callers waiting for it.
+    SingleFlightDataAccess(std::unique_ptr<DataAccess> data_access,
+                           asyncrt::Executor& executor,
+                           std::chrono::steady_clock::duration timeout = std::chrono::seconds{30});
+    ~SingleFlightDataAccess() override;
+
+    ::FfiFuture<DataResult> get_data(std::string_view key) override;
+    ::FfiFuture<bool> sleep(std::chrono::nanoseconds duration) override;
+
+private:
+    std::unique_ptr<DataAccess> m_data_access;
+    asyncrt::Executor& m_executor;
+    std::chrono::steady_clock::duration m_timeout;
+    // shared with the running requests, which may finish after this object is gone
+    std::shared_ptr<detail::Flights> m_flights;
+};
+
+}  // namespace mylib
@@ -1,12 +1,23 @@
-#include "AsyncFuture.hpp"
+#include "AsioFuture.hpp"
+#include "Coroutine.hpp"
 #include "Runtime.hpp"
+#include "Trace.hpp"
+#include "cache.hpp"
 #include "http.hpp"
 #include "mylib.hpp"
+#include "singleflight.hpp"
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <expected>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <boost/asio/io_context.hpp>
 
@@ -14,94 +25,134 @@ namespace asio = boost::asio;
 
 namespace {
 
-class StringDataHolder : public mylib::DataHolderBase {
-public:
-    StringDataHolder(std::string data)
-        : mylib::DataHolderBase{nullptr, 0}, m_data{std::move(data)} {
-        ptr = reinterpret_cast<std::uint8_t const*>(m_data.c_str());
-        len = m_data.length();
-    }
+using ShouldRunResult = std::expected<bool, asyncrt::Error>;
 
-    ~StringDataHolder() override = default;
+// Completes the future of a request with the body of its response, or fails it with the reason
+// the request failed.
+template <typename Handler>
+struct ResponseHandler {
+    void operator()(std::string&& body) { handler(std::move(body)); }
 
-private:
-    std::string m_data;
+    void operator()(http::RequestError const& error) {
+        handler.fail(asyncrt::ErrorCode::DataAccess, error.message());
+    }
+
+    Handler handler;
 };
 
 class MockDataAccess : public mylib::DataAccess {
 public:
-    MockDataAccess(boost::asio::io_context& io_context) : m_io_context{io_context} {}
+    MockDataAccess(boost::asio::io_context& io_context, asyncrt::Executor& executor)
+        : m_client{io_context}, m_executor{executor} {}
     ~MockDataAccess() override = default;
 
-    virtual ::FfiFuture<::FfiDataHolder*> get_data() override {
-        // This does not follow the Rust semantics of Future::poll(), the Boost.Asio semantics.
-        auto promise = asyncrt::Promise<std::string>{};
-        auto future = promise.get_future();
-        // TODO: use the actual URL
-        http::get(m_io_context, "api.stromgedacht.de", "/v1/now?zip=76137",
-                  [promise = std::move(promise)](std::string const& result) mutable {
-                      std::cout << "+++ [C] resolving promise: " << result << std::endl;
-                      promise.set_value(result);
-                  });
-        return asyncrt::make_cpp_future<::FfiDataHolder*>([future = std::move(future)](
-                                                              ::FfiContext* context) mutable {
-            std::cout << "+++ [C] cpp future callback             " << " with context "
-                      << reinterpret_cast<void*>(context) << ", waker "
-                      << reinterpret_cast<void const*>(context->waker) << ", vtable "
-                      << reinterpret_cast<void const*>(context->waker->vtable) << ", wake func "
-                      << reinterpret_cast<void const*>(context->waker->vtable->wake) << std::endl;
-            if (future.is_ready()) {
-                std::cout << "+++ [C] future is ready" << std::endl;
-                auto* p = new StringDataHolder{future.value()};
-                std::cout << "+++ [C] returning poll status READY" << std::endl;
-                return asyncrt::make_poll_status(static_cast<::FfiDataHolder*>(p));
-            }
-            auto waker = std::shared_ptr{
-                asyncrt::make_drop_ptr_from_raw(context->waker->vtable->clone(context->waker))};
-            std::cout << "+++ [C] cloned waker " << reinterpret_cast<void const*>(context->waker)
-                      << " as " << reinterpret_cast<void const*>(waker.get()) << std::endl;
-            future.await([waker]() {
-                // This will cause `future.poll_fn()` to be called again, this time the first
-                // branch will be taken.
-                std::cout << "+++ [C] cpp future await callback       " << " with waker "
-                          << reinterpret_cast<void const*>(waker.get()) << ", vtable "
-                          << reinterpret_cast<void const*>(waker->vtable) << std::endl;
-                std::cout << "+++ [C] wake function "
-                          << reinterpret_cast<void const*>(waker->vtable->wake) << std::endl;
-                // Waker::wake() would free the instance immediately, which leads to double-free's,
-                // so use Waker::wake_by_ref() instead
-                waker->vtable->wake_by_ref(waker.get());
-                std::cout << "+++ [C] future done" << std::endl;
+    virtual ::FfiFuture<mylib::DataResult> get_data(std::string_view key) override {
+        auto url = http::parse_url(key);
+        if (!url || url->scheme != "https") {
+            ASYNCRT_TRACE(Data, Error, "unsupported key: ", key);
+            return asyncrt::make_cpp_future<mylib::DataResult>([](::FfiContext*) {
+                return asyncrt::make_failed_poll<mylib::DataResult>(asyncrt::ErrorCode::DataAccess,
+                                                                    "unsupported key");
             });
-            std::cout << "+++ [C] returning poll status PENDING" << std::endl;
-            return asyncrt::make_poll_status<::FfiDataHolder*>(asyncrt::PollStatus::Pending);
-        });
+        }
+        // The body is moved into the data holder once Rust polls the finished request.
+        // Dropping the future before the response arrived cancels the request.
+        return asyncrt::make_asio_future<mylib::DataResult, std::string>(
+            [this, &url](auto handler) {
+                auto request = m_client.get(*url, ResponseHandler{std::move(handler)});
+                return [request]() { request.cancel(); };
+            },
+            [](std::string&& body) {
+                return asyncrt::make_ffi_ok(mylib::make_data_holder(std::move(body)));
+            });
+    }
+
+    ::FfiFuture<bool> sleep(std::chrono::nanoseconds duration) override {
+        return m_executor.sleep(duration);
     }
 
 private:
-    boost::asio::io_context& m_io_context;
+    http::Client m_client;
+    asyncrt::Executor& m_executor;
 };
 
+// Evaluates the postcodes one after another and counts those where the library should run.
+asyncrt::Lazy<std::size_t> count_should_run(mylib::Lib& lib, std::vector<std::uint32_t> postcodes) {
+    std::size_t count = 0;
+    for (auto postcode : postcodes) {
+        // postcodes which could not be evaluated are not counted
+        if (auto result = co_await lib.should_run(postcode); result && *result) {
+            ++count;
+        }
+    }
+    co_return count;
+}
+
 }  // namespace
 
-int main() {
+int main(int argc, char** argv) {
     try {
+        // optional argument: number of worker threads polling the Rust futures
+        asyncrt::ExecutorOptions options{};
+        if (argc > 1) {
+            options.worker_threads = std::stoul(argv[1]);
+        }
+
         asio::io_context io_context{};
-        asyncrt::Executor executor{io_context};
+        asyncrt::Executor executor{io_context, options};
 
-        auto data_access = std::make_unique<MockDataAccess>(io_context);
+        auto data_access = std::make_unique<mylib::CachingDataAccess>(
+            std::make_unique<mylib::SingleFlightDataAccess>(
+                std::make_unique<MockDataAccess>(io_context, executor), executor),
+            executor);
 
         auto lib = mylib::Lib{std::move(data_access)};
 
         io_context.dispatch([&executor, &lib]() {
             auto future = lib.should_run(76137);
-            executor.await(std::move(future), [](bool const& result) {
-                std::cout << "received " << result << " from mylib" << std::endl;
+            executor.await(std::move(future), [](ShouldRunResult const& result) {
+                if (result) {
+                    std::cout << "received " << *result << " from mylib" << std::endl;
+                } else {
+                    std::cout << "mylib failed: " << result.error().message() << std::endl;
+                }
+            });
+            // an invalid postcode is an ordinary error, not a panic
+            executor.await(lib.should_run(123), [](ShouldRunResult const& result) {
+                if (!result) {
+                    std::cout << "rejected postcode 123: " << result.error().message() << std::endl;
+                }
             });
+            // cancelled before its request finished, so the callback is never invoked
+            executor.await(lib.should_run(80331), [](ShouldRunResult const&) {
+                std::cout << "cancelled evaluation finished" << std::endl;
+            }).cancel();
+            executor.await(count_should_run(lib, {76137, 10115}), [](std::size_t const& count) {
+                std::cout << "should run for " << count << " of 2 postcodes" << std::endl;
+            });
+            auto postcodes = std::array<std::uint32_t, 3>{76137, 10115, 123};
+            executor.await(lib.should_run_many(postcodes),
+                           [](mylib::ShouldRunResults const& results) {
+                               for (std::size_t i = 0; i < results.size(); ++i) {
+                                   std::cout << "batch result " << i << ": "
+                                             << static_cast<int>(results[i]) << std::endl;
+                               }
+                           });
+            // later evaluations are answered from the cache
+            executor.for_each(lib.watch(76137, std::chrono::milliseconds{500}),
+                              [remaining = 3](mylib::ShouldRun const& result) mutable {
+                                  std::cout << "watched " << static_cast<int>(result)
+                                            << " from mylib" << std::endl;
+                                  return --remaining > 0;
+                              });
         });
 
         io_context.run();
         std::cout.flush();
+
+        if (std::getenv("CPPCLIENT_METRICS") != nullptr) {
+            std::cerr << executor.metrics();
+        }
     } catch (std::exception const& err) {
         std::cerr << "fatal exception: " << err.what() << std::endl;
         std::exit(EXIT_FAILURE);
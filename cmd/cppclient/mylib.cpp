@@ -1,21 +1,44 @@
 #include "mylib.hpp"
 
+#include <algorithm>
 #include <exception>
+#include <limits>
+
+#include "ffi/layout.h"
 
 namespace {
 
 struct FfiDataAccessVTable {
-    ::FfiFuture<FfiDataHolder*> (*get_data)(void*, char const*);
+    ::FfiFuture<mylib::DataResult> (*get_data)(void*, char const*);
+    ::FfiFuture<bool> (*sleep)(void*, std::uint64_t);
     void (*drop)(void*);
 };
 
 extern "C" {
 
 ::FfiLib* mylib_alloc(void* data_access, ::FfiDataAccessVTable* data_access_vtable);
-::FfiFuture<bool> mylib_should_run(::FfiLib* mylib, std::uint32_t postcode);
+::FfiFuture<::FfiResult<bool>> mylib_should_run(::FfiLib* mylib, std::uint32_t postcode);
+::FfiFuture<::FfiShouldRunResults> mylib_should_run_many(::FfiLib* mylib,
+                                                         std::uint32_t const* postcodes,
+                                                         std::size_t len);
+::FfiStream<mylib::ShouldRun> mylib_watch(::FfiLib* mylib,
+                                          std::uint32_t postcode,
+                                          std::uint64_t interval_ms);
 void mylib_free(::FfiLib* mylib);
 
 }  // extern "C"
+
+// The values returned by the library, mylibffi asserts the same sizes.
+constexpr std::size_t kWord = sizeof(void*);
+static_assert(sizeof(::FfiDataHolder) == 4 * kWord && sizeof(::FfiShouldRunResults) == 3 * kWord);
+static_assert(ffi_layout::result_matches<bool>() &&
+              sizeof(::FfiPoll<::FfiResult<bool>>) == 5 * kWord);
+static_assert(ffi_layout::result_matches<::FfiDataHolder>() &&
+              sizeof(::FfiPoll<mylib::DataResult>) == 6 * kWord);
+static_assert(ffi_layout::poll_matches<::FfiShouldRunResults>() &&
+              sizeof(::FfiPoll<::FfiShouldRunResults>) == 4 * kWord);
+static_assert(ffi_layout::stream_poll_matches<mylib::ShouldRun>() &&
+              sizeof(::FfiStreamPoll<mylib::ShouldRun>) == 2);
 }  // namespace
 
 namespace mylib {
@@ -25,12 +48,20 @@ struct DataAccessWrapper {
     DataAccessWrapper(std::unique_ptr<DataAccess> data_access)
         : vtable{
             .get_data = &DataAccessWrapper::get_data,
+            .sleep = &DataAccessWrapper::sleep,
             .drop = &DataAccessWrapper::drop,
         }
         , wrapped{std::move(data_access)} {}
 
-    static ::FfiFuture<::FfiDataHolder*> get_data(void* self, char const* key) {
-        return static_cast<DataAccessWrapper*>(self)->wrapped->get_data();
+    static ::FfiFuture<DataResult> get_data(void* self, char const* key) {
+        return static_cast<DataAccessWrapper*>(self)->wrapped->get_data(key);
+    }
+
+    static ::FfiFuture<bool> sleep(void* self, std::uint64_t nanos) {
+        // bounded, so adding the duration to the current time cannot overflow
+        constexpr std::uint64_t kMaxNanos = std::numeric_limits<std::int64_t>::max() / 2;
+        auto duration = std::chrono::nanoseconds{std::min(nanos, kMaxNanos)};
+        return static_cast<DataAccessWrapper*>(self)->wrapped->sleep(duration);
     }
 
     static void drop(void* self) {
@@ -44,7 +75,45 @@ struct DataAccessWrapper {
 
 }  // namespace
 
-DataHolderBase::~DataHolderBase() = default;
+::FfiDataHolder make_data_holder(std::string data) {
+    // the bytes of a heap allocated string do not move, even if they are stored inline
+    auto* owner = new std::string{std::move(data)};
+    return ::FfiDataHolder{
+        .ptr = reinterpret_cast<std::uint8_t const*>(owner->data()),
+        .len = owner->size(),
+        .owner = owner,
+        .drop = [](void* self) { delete static_cast<std::string*>(self); },
+    };
+}
+
+SharedData::~SharedData() {
+    m_data.drop(m_data.owner);
+}
+
+::FfiDataHolder SharedData::hand_out() const noexcept {
+    m_refs.fetch_add(1, std::memory_order_relaxed);
+    return ::FfiDataHolder{
+        .ptr = m_data.ptr,
+        .len = m_data.len,
+        .owner = const_cast<SharedData*>(this),
+        .drop = &SharedData::release,
+    };
+}
+
+void SharedData::release(void* self) noexcept {
+    auto* data = static_cast<SharedData*>(self);
+    if (data->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        ASYNCRT_TRACE(Data, Debug, "dropping shared data");
+        delete data;
+    }
+}
+
+std::shared_ptr<SharedData const> share(::FfiDataHolder data) {
+    // the shared_ptrs hold a single reference, which the deleter releases
+    return {new SharedData{data},
+            [](SharedData const* p) { SharedData::release(const_cast<SharedData*>(p)); }};
+}
+
 DataAccess::~DataAccess() = default;
 
 Lib::Lib(std::unique_ptr<DataAccess> data_access) : m_mylib{nullptr} {
@@ -63,9 +132,21 @@ Lib::~Lib() {
     }
 }
 
-asyncrt::RustFuture<bool> Lib::should_run(std::uint32_t postcode) {
+asyncrt::RustFuture<::FfiResult<bool>> Lib::should_run(std::uint32_t postcode) {
     auto ffi_future = ::mylib_should_run(m_mylib, postcode);
-    return asyncrt::RustFuture<bool>{std::move(ffi_future)};
+    return asyncrt::RustFuture<::FfiResult<bool>>{std::move(ffi_future)};
+}
+
+asyncrt::RustFuture<::FfiShouldRunResults> Lib::should_run_many(
+    std::span<std::uint32_t const> postcodes) {
+    auto ffi_future = ::mylib_should_run_many(m_mylib, postcodes.data(), postcodes.size());
+    return asyncrt::RustFuture<::FfiShouldRunResults>{std::move(ffi_future)};
+}
+
+asyncrt::RustStream<ShouldRun> Lib::watch(std::uint32_t postcode,
+                                          std::chrono::milliseconds interval) {
+    auto interval_ms = static_cast<std::uint64_t>(std::max<std::int64_t>(interval.count(), 0));
+    return asyncrt::RustStream<ShouldRun>{::mylib_watch(m_mylib, postcode, interval_ms)};
 }
 
 }  // namespace mylib
@@ -0,0 +1,239 @@
+#include "singleflight.hpp"
+
+#include <cstddef>
+#include <expected>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Drop.hpp"
+
+namespace mylib {
+namespace detail {
+
+// A request shared by all callers asking for its key while it runs.
+struct Flight {
+    explicit Flight(std::string key) : key{std::move(key)} {}
+
+    ::FfiPoll<DataResult> poll(::FfiContext* context, std::optional<std::size_t>& slot) {
+        std::lock_guard lock{mutex};
+        if (done) {
+            if (!data) {
+                // every caller gets its own copy of the error
+                auto ffi_error = error ? error->to_ffi()
+                                       : asyncrt::make_ffi_error(asyncrt::ErrorCode::DataAccess,
+                                                                 "shared request did not finish");
+                return asyncrt::make_poll_status(
+                    asyncrt::make_ffi_err<::FfiDataHolder>(ffi_error));
+            }
+            return asyncrt::make_poll_status(asyncrt::make_ffi_ok(data->hand_out()));
+        }
+        auto waker =
+            asyncrt::make_drop_ptr_from_raw(context->waker->vtable->clone(context->waker));
+        // only the waker of the latest poll has to be woken
+        if (slot) {
+            wakers[*slot] = std::move(waker);
+        } else {
+            slot = wakers.size();
+            wakers.push_back(std::move(waker));
+        }
+        return asyncrt::make_poll_status<DataResult>(asyncrt::PollStatus::Pending);
+    }
+
+    // Called with the mutex of the flights held, so a caller joining the flight cannot race with
+    // the last one leaving it.
+    void join() {
+        std::lock_guard lock{mutex};
+        ++waiters;
+    }
+
+    // Returns the task of the request, which has to be cancelled if the last caller left before
+    // it finished. Called with the mutex of the flights held.
+    std::optional<asyncrt::TaskHandle> leave() {
+        std::lock_guard lock{mutex};
+        if (--waiters > 0 || done) {
+            return std::nullopt;
+        }
+        return leader;
+    }
+
+    void set_leader(asyncrt::TaskHandle handle) {
+        std::lock_guard lock{mutex};
+        leader = handle;
+    }
+
+    // Stores the result and wakes the waiting callers. The result is null if the request failed,
+    // with the error if it returned one.
+    void finish(std::shared_ptr<SharedData const> result, std::optional<asyncrt::Error> failure) {
+        std::vector<asyncrt::DropPtr<::FfiWakerBase const>> waiting{};
+        {
+            std::lock_guard lock{mutex};
+            data = std::move(result);
+            error = std::move(failure);
+            done = true;
+            waiting.swap(wakers);
+        }
+        for (auto& waker : waiting) {
+            auto* raw = waker.release();
+            raw->vtable->wake(raw);
+        }
+    }
+
+    std::string const key;
+    std::mutex mutex{};
+    std::shared_ptr<SharedData const> data{};
+    std::optional<asyncrt::Error> error{};
+    std::vector<asyncrt::DropPtr<::FfiWakerBase const>> wakers{};
+    bool done{false};
+    // callers whose future was not dropped yet
+    std::size_t waiters{0};
+    asyncrt::TaskHandle leader{};
+};
+
+struct Flights {
+    std::mutex mutex{};
+    std::unordered_map<std::string, std::shared_ptr<Flight>, StringHash, std::equal_to<>> running{};
+};
+
+}  // namespace detail
+
+namespace {
+
+// Callback of the shared request, its error is returned to all waiting callers. If the request
+// panics, expires or is cancelled, the executor destroys the callback without calling it, and the
+// waiting callers fail with ErrorCode::DataAccess.
+class Completion {
+public:
+    Completion(std::shared_ptr<detail::Flight> flight, std::weak_ptr<detail::Flights> flights)
+        : m_flight{std::move(flight)}, m_flights{std::move(flights)} {}
+    Completion(Completion&&) = default;
+    Completion(Completion const&) = delete;
+
+    ~Completion() {
+        if (m_flight) {
+            finish(nullptr, std::nullopt);
+        }
+    }
+
+    Completion& operator=(Completion&&) = delete;
+    Completion& operator=(Completion const&) = delete;
+
+    void operator()(std::expected<::FfiDataHolder, asyncrt::Error> const& result) {
+        if (result) {
+            finish(share(*result), std::nullopt);
+        } else {
+            finish(nullptr, result.error());
+        }
+    }
+
+private:
+    void finish(std::shared_ptr<SharedData const> result, std::optional<asyncrt::Error> error) {
+        auto flight = std::move(m_flight);
+        // later requests for the key start a new flight
+        if (auto flights = m_flights.lock()) {
+            std::lock_guard lock{flights->mutex};
+            if (auto it = flights->running.find(flight->key);
+                it != flights->running.end() && it->second == flight) {
+                flights->running.erase(it);
+            }
+        }
+        flight->finish(std::move(result), std::move(error));
+    }
+
+    std::shared_ptr<detail::Flight> m_flight;
+    std::weak_ptr<detail::Flights> m_flights;
+};
+
+// A caller waiting for a flight. Once every caller dropped its future, the shared request is
+// cancelled, so it does not keep its connection busy for nobody.
+class Waiter {
+public:
+    // Called with the mutex of the flights held.
+    Waiter(std::shared_ptr<detail::Flight> flight, std::weak_ptr<detail::Flights> flights)
+        : m_flight{std::move(flight)}, m_flights{std::move(flights)} {
+        m_flight->join();
+    }
+    Waiter(Waiter&& other) noexcept = default;
+    Waiter(Waiter const&) = delete;
+
+    ~Waiter() {
+        if (!m_flight) {
+            return;
+        }
+        std::optional<asyncrt::TaskHandle> leader{};
+        if (auto flights = m_flights.lock()) {
+            std::lock_guard lock{flights->mutex};
+            leader = m_flight->leave();
+            // later requests for the key start a new flight instead of joining the cancelled one
+            if (auto it = flights->running.find(m_flight->key);
+                leader && it != flights->running.end() && it->second == m_flight) {
+                flights->running.erase(it);
+            }
+        }
+        if (leader) {
+            leader->cancel();
+        }
+    }
+
+    Waiter& operator=(Waiter&&) = delete;
+    Waiter& operator=(Waiter const&) = delete;
+
+    ::FfiPoll<DataResult> poll(::FfiContext* context) {
+        return m_flight->poll(context, m_slot);
+    }
+
+private:
+    std::shared_ptr<detail::Flight> m_flight;
+    std::weak_ptr<detail::Flights> m_flights;
+    std::optional<std::size_t> m_slot{};
+};
+
+}  // namespace
+
+SingleFlightDataAccess::SingleFlightDataAccess(std::unique_ptr<DataAccess> data_access,
+                                               asyncrt::Executor& executor,
+                                               std::chrono::steady_clock::duration timeout)
+    : m_data_access{std::move(data_access)},
+      m_executor{executor},
+      m_timeout{timeout},
+      m_flights{std::make_shared<detail::Flights>()} {}
+
+SingleFlightDataAccess::~SingleFlightDataAccess() = default;
+
+::FfiFuture<DataResult> SingleFlightDataAccess::get_data(std::string_view key) {
+    std::shared_ptr<detail::Flight> flight{};
+    std::optional<Waiter> waiter{};
+    bool leader = false;
+    {
+        std::lock_guard lock{m_flights->mutex};
+        if (auto it = m_flights->running.find(key); it != m_flights->running.end()) {
+            flight = it->second;
+        } else {
+            flight = std::make_shared<detail::Flight>(std::string{key});
+            m_flights->running.emplace(flight->key, flight);
+            leader = true;
+        }
+        waiter.emplace(flight, m_flights);
+    }
+    if (leader) {
+        // Started outside of the lock, the request may complete right away. On expiry or
+        // cancellation, the completion is destroyed without being called, which fails the flight.
+        flight->set_leader(m_executor.await_with_deadline(
+            asyncrt::RustFuture{m_data_access->get_data(key)},
+            std::chrono::steady_clock::now() + m_timeout, Completion{flight, m_flights},
+            []() { ASYNCRT_TRACE(Data, Warning, "shared request timed out"); }));
+    }
+    return asyncrt::make_cpp_future<DataResult>(
+        [waiter = std::move(*waiter)](::FfiContext* context) mutable {
+            return waiter.poll(context);
+        });
+}
+
+::FfiFuture<bool> SingleFlightDataAccess::sleep(std::chrono::nanoseconds duration) {
+    return m_data_access->sleep(duration);
+}
+
+}  // namespace mylib
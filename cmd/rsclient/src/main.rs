@@ -1,4 +1,4 @@
-use std::error::Error;
+use std::{error::Error, time::Duration};
 
 use async_trait::async_trait;
 
@@ -23,6 +23,10 @@ impl DataAccess for MyTransport {
         let data = res.body_bytes().await?;
         Ok(Box::new(MyDataHolder { data }))
     }
+
+    async fn sleep(&self, duration: Duration) {
+        async_io::Timer::after(duration).await;
+    }
 }
 
 fn main() {
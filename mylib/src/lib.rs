@@ -1,17 +1,40 @@
-use std::{error::Error, fmt::Display};
+use std::{error::Error, fmt::Display, time::Duration};
 
 use async_trait::async_trait;
+use futures::{
+    future::join_all,
+    stream::{self, Stream},
+};
 use serde::Deserialize;
 
 // Trait to hold data without copying and being able to free it with the correct allocator.
-pub trait DataHolder {
+// Holders are Send, so batches of them can be awaited on multi-threaded executors.
+pub trait DataHolder: Send {
     fn bytes(&self) -> &[u8];
 }
 
+// Error of a single item of a batch or stream, it has to be Send for the same reason.
+pub type BatchError = Box<dyn Error + Send + Sync>;
+
 #[cfg_attr(target_arch = "wasm32", async_trait(?Send))]
 #[cfg_attr(not(target_arch = "wasm32"), async_trait)]
 pub trait DataAccess {
     async fn get_data(&self, key: &str) -> Result<Box<dyn DataHolder>, Box<dyn Error>>;
+
+    // Fetches several keys, the results are in the order of the keys. By default the keys are
+    // fetched concurrently with get_data(), implementations may fetch them in a single request.
+    async fn get_data_many(&self, keys: &[String]) -> Vec<Result<Box<dyn DataHolder>, BatchError>> {
+        join_all(keys.iter().map(|key| async move {
+            self.get_data(key)
+                .await
+                .map_err(|err| BatchError::from(err.to_string()))
+        }))
+        .await
+    }
+
+    // Completes once the duration passed. The library does not depend on a runtime, so the timers
+    // of the runtime it is used with are passed in here.
+    async fn sleep(&self, duration: Duration);
 }
 
 #[derive(Debug)]
@@ -58,9 +81,49 @@ impl<D: DataAccess> Lib<D> {
     }
 
     pub async fn should_run(&self, postcode: Postcode) -> Result<bool, Box<dyn Error>> {
-        let k = format!("https://api.stromgedacht.de/v1/now?zip={}", postcode.code);
-        let resp = self.data_access.get_data(&k).await?;
-        let data = &resp.bytes();
+        let resp = self.data_access.get_data(&Self::key(&postcode)).await?;
+        Self::parse(resp.bytes()).map_err(|err| err as Box<dyn Error>)
+    }
+
+    // Evaluates several postcodes with a single batch from the data access, the results are in
+    // the order of the postcodes.
+    pub async fn should_run_many(&self, postcodes: &[Postcode]) -> Vec<Result<bool, BatchError>>
+    where
+        D: Sync,
+    {
+        let keys: Vec<String> = postcodes.iter().map(Self::key).collect();
+        self.data_access
+            .get_data_many(&keys)
+            .await
+            .into_iter()
+            .map(|resp| -> Result<bool, BatchError> { Self::parse(resp?.bytes()) })
+            .collect()
+    }
+
+    // Evaluates the postcode right away and then again after every interval, the stream never
+    // ends. Errors are yielded as items, so a failed evaluation does not end the stream.
+    pub fn watch(
+        &self,
+        postcode: Postcode,
+        interval: Duration,
+    ) -> impl Stream<Item = Result<bool, BatchError>> + '_ {
+        stream::unfold((Self::key(&postcode), false), move |(key, wait)| async move {
+            if wait {
+                self.data_access.sleep(interval).await;
+            }
+            let result = match self.data_access.get_data(&key).await {
+                Ok(resp) => Self::parse(resp.bytes()),
+                Err(err) => Err(BatchError::from(err.to_string())),
+            };
+            Some((result, (key, true)))
+        })
+    }
+
+    fn key(postcode: &Postcode) -> String {
+        format!("https://api.stromgedacht.de/v1/now?zip={}", postcode.code)
+    }
+
+    fn parse(data: &[u8]) -> Result<bool, BatchError> {
         if data.is_empty() {
             return Err(Box::new(MyError::InvalidData));
         }
@@ -72,9 +135,27 @@ impl<D: DataAccess> Lib<D> {
 #[cfg(test)]
 mod test {
     use super::*;
+    use std::sync::Mutex;
+
+    #[derive(Debug, PartialEq)]
+    enum Call {
+        GetData,
+        Sleep(Duration),
+    }
 
     struct MockDataAccess {
         state: i8,
+        // the calls of the library, in order
+        calls: Mutex<Vec<Call>>,
+    }
+
+    impl MockDataAccess {
+        fn new(state: i8) -> Self {
+            MockDataAccess {
+                state,
+                calls: Mutex::new(Vec::new()),
+            }
+        }
     }
 
     impl DataHolder for Vec<u8> {
@@ -86,16 +167,59 @@ mod test {
     #[async_trait]
     impl DataAccess for MockDataAccess {
         async fn get_data(&self, _key: &str) -> Result<Box<dyn DataHolder>, Box<dyn Error>> {
+            self.calls.lock().unwrap().push(Call::GetData);
             let s = format!(r#"{{"state":{}}}"#, self.state);
             Ok(Box::new(Vec::from(s.as_bytes())))
         }
+
+        async fn sleep(&self, duration: Duration) {
+            self.calls.lock().unwrap().push(Call::Sleep(duration));
+        }
     }
 
     #[futures_test::test]
     async fn test_should_run() -> Result<(), Box<dyn Error>> {
-        let data_access = MockDataAccess { state: 1 };
+        let data_access = MockDataAccess::new(1);
         let lib = Lib::new(data_access);
         assert!(lib.should_run(Postcode::new(76137).unwrap()).await?);
         Ok(())
     }
+
+    #[futures_test::test]
+    async fn test_should_run_many() {
+        let data_access = MockDataAccess::new(2);
+        let lib = Lib::new(data_access);
+        let postcodes = [Postcode::new(76137).unwrap(), Postcode::new(10115).unwrap()];
+        let results = lib.should_run_many(&postcodes).await;
+        assert_eq!(results.len(), 2);
+        assert!(results.iter().all(|result| matches!(result, Ok(false))));
+    }
+
+    #[futures_test::test]
+    async fn test_watch() {
+        use futures::StreamExt;
+
+        let data_access = MockDataAccess::new(1);
+        let lib = Lib::new(data_access);
+        let interval = Duration::from_millis(10);
+        let results: Vec<_> = lib
+            .watch(Postcode::new(76137).unwrap(), interval)
+            .take(3)
+            .collect()
+            .await;
+        assert_eq!(results.len(), 3);
+        assert!(results.iter().all(|result| matches!(result, Ok(true))));
+        // the first item is evaluated right away, every later one after an interval
+        let calls = lib.data_access.calls.lock().unwrap();
+        assert_eq!(
+            *calls,
+            [
+                Call::GetData,
+                Call::Sleep(interval),
+                Call::GetData,
+                Call::Sleep(interval),
+                Call::GetData,
+            ]
+        );
+    }
 }
@@ -0,0 +1,85 @@
+//! Synthetic futures for benchmarking the FFI round-trip between a foreign executor and Rust.
+
+use core::{
+    future::Future,
+    pin::Pin,
+    task::{Context, Poll, Waker},
+};
+use std::{
+    sync::{mpsc, Mutex, OnceLock},
+    thread,
+};
+
+use async_ffi::{FfiFuture, FutureExt};
+
+/// Returns `Pending` the given number of times before it is ready with the number of polls.
+struct PendingFuture {
+    remaining: u32,
+    polls: u64,
+    wake: fn(&Waker),
+}
+
+impl Future for PendingFuture {
+    type Output = u64;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<u64> {
+        self.polls += 1;
+        if self.remaining == 0 {
+            return Poll::Ready(self.polls);
+        }
+        self.remaining -= 1;
+        (self.wake)(cx.waker());
+        Poll::Pending
+    }
+}
+
+/// Background thread waking the wakers sent to it.
+fn waker_thread() -> &'static Mutex<mpsc::Sender<Waker>> {
+    static SENDER: OnceLock<Mutex<mpsc::Sender<Waker>>> = OnceLock::new();
+    SENDER.get_or_init(|| {
+        let (sender, receiver) = mpsc::channel::<Waker>();
+        thread::spawn(move || {
+            for waker in receiver {
+                waker.wake();
+            }
+        });
+        Mutex::new(sender)
+    })
+}
+
+fn wake_from_thread(waker: &Waker) {
+    waker_thread()
+        .lock()
+        .expect("waker thread poisoned")
+        .send(waker.clone())
+        .expect("waker thread stopped");
+}
+
+/// Future which is ready on the first poll.
+#[no_mangle]
+pub extern "C" fn mylib_bench_ready(value: u64) -> FfiFuture<u64> {
+    async move { value }.into_ffi()
+}
+
+/// Future which wakes itself by reference and returns `Pending` `count` times.
+#[no_mangle]
+pub extern "C" fn mylib_bench_pending(count: u32) -> FfiFuture<u64> {
+    PendingFuture {
+        remaining: count,
+        polls: 0,
+        wake: Waker::wake_by_ref,
+    }
+    .into_ffi()
+}
+
+/// Future which returns `Pending` `count` times, its waker is cloned and woken from another
+/// thread each time.
+#[no_mangle]
+pub extern "C" fn mylib_bench_wake_from_thread(count: u32) -> FfiFuture<u64> {
+    PendingFuture {
+        remaining: count,
+        polls: 0,
+        wake: wake_from_thread,
+    }
+    .into_ffi()
+}
@@ -1,33 +1,48 @@
 // Nearly everything is unsafe because of FFI
 #![allow(clippy::missing_safety_doc)]
 
-use core::{ffi::c_char, slice};
-use std::{error::Error, ffi::CString};
+use core::{
+    ffi::{c_char, c_void},
+    mem::size_of,
+    ptr, slice,
+};
+use std::{error::Error, ffi::CString, time::Duration};
 
-use async_ffi::{FfiFuture, FutureExt};
+use async_ffi::{FfiFuture, FfiPoll, FutureExt};
 use async_trait::async_trait;
+use futures::{future, stream, StreamExt};
 
 use mylib::*;
 
+pub mod bench;
+pub mod result;
+pub mod stream;
+
+use crate::result::{FfiError, FfiResult};
+use crate::stream::{FfiStream, FfiStreamExt};
+
+/// Bytes passed by value, the owner keeps them alive until `drop` is called with it.
 #[repr(C)]
 pub struct FfiDataHolder {
     ptr: *const u8,
     len: usize,
-    drop: unsafe extern "C" fn(*const FfiDataHolder),
-    _pin: core::marker::PhantomPinned,
+    owner: *mut c_void,
+    drop: unsafe extern "C" fn(*mut c_void),
 }
 
-// Extra layer of indirection, should be replaced by proper use of magic
 struct DataWrapper {
-    data_holder: *const FfiDataHolder,
+    data_holder: FfiDataHolder,
 }
 
+// The C++ data holders can be dropped on any thread.
+unsafe impl Send for DataWrapper {}
+
 impl DataHolder for DataWrapper {
     fn bytes(&self) -> &[u8] {
         eprintln!("+++ [R] DataWrapper::byte");
         unsafe {
-            let ptr = (*(self.data_holder)).ptr;
-            let len = (*(self.data_holder)).len;
+            let ptr = self.data_holder.ptr;
+            let len = self.data_holder.len;
             eprintln!("+++ [R] DataWrapper::bytes: ptr={:?}, len={}", ptr, len);
             slice::from_raw_parts(ptr, len)
         }
@@ -38,7 +53,7 @@ impl Drop for DataWrapper {
     fn drop(&mut self) {
         eprintln!("+++ [R] DataWrapper::drop");
         unsafe {
-            ((*(self.data_holder)).drop)(self.data_holder);
+            (self.data_holder.drop)(self.data_holder.owner);
         }
     }
 }
@@ -47,9 +62,14 @@ pub struct FfiDataAccess;
 
 #[repr(C)]
 pub struct FfiDataAccessVTable {
-    /// The returned data is exclusively owned by the caller.
-    get_data:
-        unsafe extern "C" fn(*mut FfiDataAccess, *const c_char) -> FfiFuture<*mut FfiDataHolder>,
+    /// The returned data is exclusively owned by the caller, an error keeps its code when it is
+    /// passed on by `mylib_should_run()`.
+    get_data: unsafe extern "C" fn(
+        *mut FfiDataAccess,
+        *const c_char,
+    ) -> FfiFuture<FfiResult<FfiDataHolder>>,
+    /// Completes once the given number of nanoseconds passed, the value is ignored.
+    sleep: unsafe extern "C" fn(*mut FfiDataAccess, u64) -> FfiFuture<bool>,
     drop: unsafe extern "C" fn(*mut FfiDataAccess),
 }
 
@@ -80,12 +100,32 @@ impl DataAccess for DataAccessWrapper {
         unsafe {
             let sp = pin.as_ptr();
             eprintln!("+++ [R] getting data");
-            let data_holder = ((*(self.vtable)).get_data)(self.data, sp).await;
+            let result = ((*(self.vtable)).get_data)(self.data, sp).await;
+            let data_holder = Result::from(result)?;
             Ok(Box::new(DataWrapper { data_holder }))
         }
     }
+
+    async fn sleep(&self, duration: Duration) {
+        let nanos = u64::try_from(duration.as_nanos()).unwrap_or(u64::MAX);
+        unsafe {
+            ((*(self.vtable)).sleep)(self.data, nanos).await;
+        }
+    }
 }
 
+// The values passed to and returned from C++, whose mirrors in cmd/cppclient/mylib.cpp assert the
+// same sizes.
+const WORD: usize = size_of::<usize>();
+const _: () = {
+    assert!(size_of::<FfiDataHolder>() == 4 * WORD);
+    assert!(size_of::<FfiShouldRunResults>() == 3 * WORD);
+    assert!(size_of::<FfiPoll<FfiResult<bool>>>() == 5 * WORD);
+    assert!(size_of::<FfiPoll<FfiResult<FfiDataHolder>>>() == 6 * WORD);
+    assert!(size_of::<FfiPoll<FfiShouldRunResults>>() == 4 * WORD);
+    assert!(size_of::<stream::FfiStreamPoll<u8>>() == 2);
+};
+
 pub struct FfiLib {
     instance: Lib<DataAccessWrapper>,
     _pin: core::marker::PhantomPinned,
@@ -108,21 +148,119 @@ pub unsafe extern "C" fn mylib_alloc(
     Box::into_raw(lib)
 }
 
+/// Errors, including an invalid postcode, are returned as results, so the future only panics on
+/// bugs.
 #[no_mangle]
-pub unsafe extern "C" fn mylib_should_run(ffi_lib: *mut FfiLib, postcode: u32) -> FfiFuture<bool> {
+pub unsafe extern "C" fn mylib_should_run(
+    ffi_lib: *mut FfiLib,
+    postcode: u32,
+) -> FfiFuture<FfiResult<bool>> {
     eprintln!("+++ [R] mylib_should_run");
     let lib = &(*ffi_lib).instance;
-    // TODO: return proper error
-    let postcode = Postcode::new(postcode).unwrap();
-    async {
-        match lib.should_run(postcode).await {
-            Ok(value) => value,
-            Err(e) => panic!("error from mylib: {}", e),
+    let postcode = Postcode::new(postcode);
+    async move {
+        let result = match postcode {
+            Ok(postcode) => lib
+                .should_run(postcode)
+                .await
+                .map_err(|err| FfiError::from_error(err.as_ref())),
+            Err(err) => Err(FfiError::from_error(&err)),
+        };
+        FfiResult::from(result)
+    }
+    .into_ffi()
+}
+
+const SHOULD_RUN_NO: u8 = 0;
+const SHOULD_RUN_YES: u8 = 1;
+const SHOULD_RUN_ERROR: u8 = 2;
+
+fn should_run_code(result: &Result<bool, BatchError>) -> u8 {
+    match result {
+        Ok(true) => SHOULD_RUN_YES,
+        Ok(false) => SHOULD_RUN_NO,
+        Err(_) => SHOULD_RUN_ERROR,
+    }
+}
+
+/// Results of `mylib_should_run_many()`, one per postcode. Must be freed by calling `drop`.
+#[repr(C)]
+pub struct FfiShouldRunResults {
+    ptr: *mut u8,
+    len: usize,
+    drop: unsafe extern "C" fn(*mut u8, usize),
+}
+
+// The results exclusively own their buffer.
+unsafe impl Send for FfiShouldRunResults {}
+
+unsafe extern "C" fn drop_should_run_results(ptr: *mut u8, len: usize) {
+    drop(Box::from_raw(ptr::slice_from_raw_parts_mut(ptr, len)));
+}
+
+/// Evaluates several postcodes with a single future. Invalid postcodes and postcodes whose data
+/// could not be fetched are reported as errors, instead of failing the whole batch.
+#[no_mangle]
+pub unsafe extern "C" fn mylib_should_run_many(
+    ffi_lib: *mut FfiLib,
+    postcodes: *const u32,
+    len: usize,
+) -> FfiFuture<FfiShouldRunResults> {
+    eprintln!("+++ [R] mylib_should_run_many");
+    let lib = &(*ffi_lib).instance;
+    // copied, as the postcodes are only valid during the call
+    let postcodes = if len == 0 {
+        Vec::new()
+    } else {
+        slice::from_raw_parts(postcodes, len).to_vec()
+    };
+    async move {
+        let valid: Vec<Postcode> = postcodes
+            .iter()
+            .filter_map(|&code| Postcode::new(code).ok())
+            .collect();
+        let mut fetched = lib.should_run_many(&valid).await.into_iter();
+        let results: Box<[u8]> = postcodes
+            .iter()
+            .map(|&code| {
+                if Postcode::new(code).is_err() {
+                    return SHOULD_RUN_ERROR;
+                }
+                fetched
+                    .next()
+                    .map_or(SHOULD_RUN_ERROR, |result| should_run_code(&result))
+            })
+            .collect();
+        let len = results.len();
+        FfiShouldRunResults {
+            ptr: Box::into_raw(results).cast::<u8>(),
+            len,
+            drop: drop_should_run_results,
         }
     }
     .into_ffi()
 }
 
+/// Evaluates the postcode right away and then every `interval_ms` milliseconds, with the same
+/// encoding as `mylib_should_run_many()`. An invalid postcode yields a single error before the
+/// stream ends.
+#[no_mangle]
+pub unsafe extern "C" fn mylib_watch(
+    ffi_lib: *mut FfiLib,
+    postcode: u32,
+    interval_ms: u64,
+) -> FfiStream<u8> {
+    eprintln!("+++ [R] mylib_watch");
+    let lib = &(*ffi_lib).instance;
+    match Postcode::new(postcode) {
+        Ok(postcode) => lib
+            .watch(postcode, Duration::from_millis(interval_ms))
+            .map(|result| should_run_code(&result))
+            .into_ffi(),
+        Err(_) => stream::once(future::ready(SHOULD_RUN_ERROR)).into_ffi(),
+    }
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn mylib_free(lib: *mut FfiLib) {
     eprintln!("+++ [R] mylib_free");
@@ -0,0 +1,135 @@
+//! Errors passed through the C ABI as ordinary results, so failures do not have to unwind as
+//! panics and keep their reason.
+
+use core::{ffi::c_char, fmt, ptr};
+use std::{error::Error, ffi::CStr, ffi::CString};
+
+use mylib::MyError;
+
+/// Kind of an `FfiError`.
+#[repr(u8)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum FfiErrorCode {
+    /// An error without a more specific code, e.g. a C++ exception.
+    Internal,
+    InvalidPostcode,
+    /// The data could not be parsed.
+    InvalidData,
+    /// The data could not be fetched.
+    DataAccess,
+}
+
+/// An error code and an optional message, which is freed with `drop` by the side which received
+/// the error.
+#[repr(C)]
+pub struct FfiError {
+    code: FfiErrorCode,
+    message: *mut c_char,
+    drop: unsafe extern "C" fn(*mut c_char),
+}
+
+// The error exclusively owns its message, which is never modified.
+unsafe impl Send for FfiError {}
+unsafe impl Sync for FfiError {}
+
+unsafe extern "C" fn drop_message(message: *mut c_char) {
+    drop(CString::from_raw(message));
+}
+
+impl FfiError {
+    pub fn new(code: FfiErrorCode, message: &str) -> Self {
+        // a message with a nul byte is cut off there
+        let message = CString::new(message).unwrap_or_else(|err| {
+            let end = err.nul_position();
+            CString::new(&err.into_vec()[..end]).unwrap_or_default()
+        });
+        FfiError {
+            code,
+            message: message.into_raw(),
+            drop: drop_message,
+        }
+    }
+
+    /// Maps the errors of the library and the errors received from the data access to codes.
+    pub fn from_error(err: &(dyn Error + 'static)) -> Self {
+        let code = if let Some(err) = err.downcast_ref::<FfiError>() {
+            err.code
+        } else if let Some(err) = err.downcast_ref::<MyError>() {
+            match err {
+                MyError::InvalidData => FfiErrorCode::InvalidData,
+                MyError::InvalidPostcode => FfiErrorCode::InvalidPostcode,
+            }
+        } else if err.is::<serde_json::Error>() {
+            FfiErrorCode::InvalidData
+        } else {
+            FfiErrorCode::Internal
+        };
+        FfiError::new(code, &err.to_string())
+    }
+
+    pub fn code(&self) -> FfiErrorCode {
+        self.code
+    }
+
+    pub fn message(&self) -> Option<&CStr> {
+        if self.message.is_null() {
+            None
+        } else {
+            unsafe { Some(CStr::from_ptr(self.message)) }
+        }
+    }
+}
+
+impl Drop for FfiError {
+    fn drop(&mut self) {
+        let message = core::mem::replace(&mut self.message, ptr::null_mut());
+        if !message.is_null() {
+            unsafe { (self.drop)(message) }
+        }
+    }
+}
+
+impl fmt::Debug for FfiError {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("FfiError")
+            .field("code", &self.code)
+            .field("message", &self.message())
+            .finish()
+    }
+}
+
+impl fmt::Display for FfiError {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self.message() {
+            Some(message) => write!(f, "{}", message.to_string_lossy()),
+            None => write!(f, "{:?}", self.code),
+        }
+    }
+}
+
+impl Error for FfiError {}
+
+/// `Result` with a layout which can be passed through the C ABI.
+#[repr(C, u8)]
+pub enum FfiResult<T> {
+    Ok(T),
+    Err(FfiError),
+}
+
+impl<T> From<Result<T, FfiError>> for FfiResult<T> {
+    fn from(result: Result<T, FfiError>) -> Self {
+        match result {
+            Ok(value) => FfiResult::Ok(value),
+            Err(err) => FfiResult::Err(err),
+        }
+    }
+}
+
+impl<T> From<FfiResult<T>> for Result<T, FfiError> {
+    fn from(result: FfiResult<T>) -> Self {
+        match result {
+            FfiResult::Ok(value) => Ok(value),
+            FfiResult::Err(err) => Err(err),
+        }
+    }
+}
@@ -0,0 +1,70 @@
+//! Streams polled from a foreign executor, the counterpart of `FfiFuture` for any number of values.
+
+use core::{pin::Pin, task::Poll};
+use std::panic::{self, AssertUnwindSafe};
+
+use async_ffi::FfiContext;
+use futures::stream::Stream;
+
+/// Result of polling an `FfiStream`. Like `FfiPoll`, but `Done` once the stream ended.
+#[repr(C, u8)]
+pub enum FfiStreamPoll<T> {
+    Ready(T),
+    Pending,
+    Panicked,
+    Done,
+}
+
+/// A `Stream` which can be polled through the C ABI. It has to be freed by calling `drop_fn`.
+#[repr(C)]
+pub struct FfiStream<T> {
+    stream_ptr: *mut (),
+    poll_next_fn: unsafe extern "C" fn(*mut (), *mut FfiContext) -> FfiStreamPoll<T>,
+    drop_fn: unsafe extern "C" fn(*mut ()),
+}
+
+// Only Send streams are wrapped.
+unsafe impl<T: Send> Send for FfiStream<T> {}
+
+impl<T> FfiStream<T> {
+    pub fn new<S: Stream<Item = T> + Send + 'static>(stream: S) -> Self {
+        unsafe extern "C" fn poll_next_fn<S: Stream>(
+            stream_ptr: *mut (),
+            context_ptr: *mut FfiContext,
+        ) -> FfiStreamPoll<S::Item> {
+            let result = panic::catch_unwind(AssertUnwindSafe(|| {
+                // the stream is boxed, so it is never moved
+                let stream = Pin::new_unchecked(&mut *stream_ptr.cast::<S>());
+                (*context_ptr).with_context(|cx| stream.poll_next(cx))
+            }));
+            match result {
+                Ok(Poll::Ready(Some(item))) => FfiStreamPoll::Ready(item),
+                Ok(Poll::Ready(None)) => FfiStreamPoll::Done,
+                Ok(Poll::Pending) => FfiStreamPoll::Pending,
+                Err(_) => FfiStreamPoll::Panicked,
+            }
+        }
+
+        unsafe extern "C" fn drop_fn<S>(stream_ptr: *mut ()) {
+            // a panic must not unwind into the foreign caller
+            let _ = panic::catch_unwind(AssertUnwindSafe(|| {
+                drop(Box::from_raw(stream_ptr.cast::<S>()));
+            }));
+        }
+
+        FfiStream {
+            stream_ptr: Box::into_raw(Box::new(stream)).cast(),
+            poll_next_fn: poll_next_fn::<S>,
+            drop_fn: drop_fn::<S>,
+        }
+    }
+}
+
+pub trait FfiStreamExt: Stream + Send + Sized + 'static {
+    /// Wraps the stream, so it can be handed to a foreign executor.
+    fn into_ffi(self) -> FfiStream<Self::Item> {
+        FfiStream::new(self)
+    }
+}
+
+impl<S: Stream + Send + 'static> FfiStreamExt for S {}